@@ -0,0 +1,103 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "bulk.h"
+#include "common.h"
+#include "logger.h"
+
+struct bulk {
+	struct proto *proto;
+	uint32_t addr;
+	uint32_t len;
+	uint32_t sent;
+	uint32_t acked;
+	uint8_t region;
+	uint8_t seq;
+};
+
+static struct bulk bulk;
+
+uint8_t bulk_proto_read(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
+{
+	struct proto_read r;
+	uint32_t start;
+	uint32_t end;
+
+	memcpy(&r, req, sizeof(r));
+	if (r.region == BULK_REGION_FLASH) {
+		start = FLASH_BASE;
+		end = FLASH_BANK1_END + 1;
+	} else if (r.region == BULK_REGION_LOG) {
+		start = 0;
+		end = LOGGER_SIZE;
+	} else {
+		return PROTO_ERR_ARG;
+	}
+
+	if (r.addr < start || r.addr > end)
+		return PROTO_ERR_ARG;
+
+	if (r.len > end - r.addr)
+		r.len = end - r.addr;
+
+	bulk.proto = p;
+	bulk.region = r.region;
+	bulk.addr = r.addr;
+	bulk.len = r.len;
+	bulk.sent = 0;
+	bulk.acked = 0;
+	// Data frames are matched with request by seq
+	bulk.seq = p->rx_seq;
+	memcpy(resp, &r.len, 4);
+	*resp_len = 4;
+
+	return PROTO_OK;
+}
+
+uint8_t bulk_proto_ack(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
+{
+	uint32_t offset;
+
+	memcpy(&offset, req, 4);
+	if (p != bulk.proto || offset < bulk.acked || offset > bulk.sent)
+		return PROTO_ERR_ARG;
+
+	bulk.acked = offset;
+	if (req[4] & PROTO_READ_RETRY)
+		bulk.sent = offset;
+
+	return PROTO_OK;
+}
+
+void bulk_process(void)
+{
+	uint8_t chunk[PROTO_MAX_PAYLOAD];
+
+	// Read is canceled together with binary protocol
+	if (bulk.proto && !bulk.proto->is_active)
+		bulk.proto = NULL;
+
+	if (!bulk.proto)
+		return;
+
+	while (bulk.sent < bulk.len && bulk.sent - bulk.acked < BULK_WINDOW * BULK_CHUNK) {
+		unsigned int n = bulk.len - bulk.sent;
+
+		if (n > BULK_CHUNK)
+			n = BULK_CHUNK;
+
+		memcpy(chunk, &bulk.sent, 4);
+		if (bulk.region == BULK_REGION_FLASH)
+			memcpy(&chunk[4], (void *)(bulk.addr + bulk.sent), n);
+		else
+			logger_read(bulk.addr + bulk.sent, &chunk[4], n);
+
+		// Chunk is sent again on the next pass
+		if (proto_try_send(bulk.proto, PROTO_MSG_READ_DATA, bulk.seq, chunk, n + 4))
+			break;
+
+		bulk.sent += n;
+	}
+}
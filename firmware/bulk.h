@@ -0,0 +1,27 @@
+#ifndef _BULK_H
+#define _BULK_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "proto.h"
+
+// Bulk read of flash and fuel log over binary protocol. After PROTO_MSG_READ device sends
+// PROTO_MSG_READ_DATA frames (each chunk has CRC16 of frame) with the seq of request, but no more
+// than BULK_WINDOW chunks ahead of the last PROTO_MSG_READ_ACK. Host requests lost chunks again by
+// acknowledgement with PROTO_READ_RETRY
+#define BULK_REGION_FLASH	0  // addr is address in flash
+#define BULK_REGION_LOG		1  // addr is offset in fuel log from the oldest page (see logger_read)
+
+#define BULK_CHUNK		(PROTO_MAX_PAYLOAD - 4)  // data in PROTO_MSG_READ_DATA after offset
+#define BULK_WINDOW		16  // chunks
+
+// Handler of PROTO_MSG_READ: req is struct proto_read, resp is uint32_t length of data which will
+// be sent (request is truncated by the end of region). New request cancels previous one
+uint8_t bulk_proto_read(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+// Handler of PROTO_MSG_READ_ACK: req is uint32_t offset, uint8_t flags
+uint8_t bulk_proto_ack(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+// Called from main loop: sends chunks while they fit into transmit buffer
+void bulk_process(void);
+
+#endif  // _BULK_H
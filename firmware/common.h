@@ -7,6 +7,9 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define BIT(x) (1 << (x))
+// Code which has to run while flash is erased or programmed: CPU stalls on every fetch from flash
+// then. Section is copied to RAM together with .data at startup
+#define RAMFUNC __attribute__((section(".ramfunc")))
 // #define GENMASK(h, l) (((1 << ((h) - (l) + 1)) - 1) << (l))
 // #define __bf_shf(x) (__builtin_ffsll(x) - 1)
 // #define FIELD_PREP(_mask, _val) (((typeof(_mask))(_val) << __bf_shf(_mask)) & (_mask))
@@ -0,0 +1,604 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "common.h"
+#include "console.h"
+#include "env.h"
+#include "monitor.h"
+#include "proto.h"
+#include "usart.h"
+
+#define ESC_UP		0x5b41
+#define ESC_DOWN	0x5b42
+#define ESC_RIGHT	0x5b43
+#define ESC_LEFT	0x5b44
+
+#define ESC_INS		0x5b327e
+#define ESC_DEL		0x5b337e
+#define ESC_PGUP	0x5b357e
+#define ESC_PGDOWN	0x5b367e
+
+#define ESC_END		0x5b46
+#define ESC_END2	0x4f46
+#define ESC_HOME	0x5b48
+#define ESC_HOME2	0x5b317e
+
+#define ESC_F1		0x4f50
+#define ESC_F2		0x4f51
+
+// Sorted by name (see linker script)
+extern const struct command __cmds_start[];
+extern const struct command __cmds_end[];
+
+static struct console *consoles;
+static unsigned int consoles_count;
+
+ENV_VAR(tx_policy, ENV_SLOT_TX_POLICY, USART_TX_BLOCK, USART_TX_BLOCK, USART_TX_TRUNCATE, NULL, "что делать с выводом в консоль, если буфер передачи заполнен: 0 - ждать, 1 - отбрасывать, 2 - обрезать с маркером '~'");
+ENV_VAR(baudrate, ENV_SLOT_BAUDRATE, CONSOLE_BAUDRATE, 1200, 2250000, "бод", "скорость консоли после включения (бод)");
+
+uint32_t str_to_uint32(char *s, bool *ok)
+{
+	int base = 10;
+	uint32_t value = 0;
+
+	if (s[0] == '0') {
+		switch (s[1]) {
+		case 'x':
+			base = 16;
+			s = s + 2;
+			break;
+		case 'o':
+			base = 8;
+			s = s + 2;
+			break;
+		case 'b':
+			base = 2;
+			s = s + 2;
+			break;
+		default:
+			break;
+		}
+	}
+
+	while (*s) {
+		uint8_t tmp = *s;
+
+		value *= base;
+		if (base == 16) {
+			if (tmp >= 'A' && tmp <= 'F')
+				tmp = tmp - 'A' + 10;
+			else if (tmp >= 'a' && tmp <= 'f')
+				tmp = tmp - 'a' + 10;
+		} else
+			tmp -= '0';
+
+		if (tmp >= base) {
+			if (ok)
+				*ok = false;
+
+			return value;
+		}
+
+		value += tmp;
+		s++;
+	}
+
+	if (ok)
+		*ok = true;
+
+	return value;
+}
+
+static void print_help_text(uint8_t num, const char *s)
+{
+	int col = 4;
+
+	usart_puts(num, "          ");
+	while (*s) {
+		if (((uint8_t)*s & 0xc0) != 0x80)  // if ASCII or first byte of UTF-8 symbol
+			col++;
+
+		if ((*s == ' ' && col >= 80) || (*s == '\n')) {
+			usart_puts(num, "\n          ");
+			col = 4;
+		} else {
+			usart_putc(num, *s);
+		}
+
+		s++;
+	}
+	usart_putc(num, '\n');
+}
+
+struct console *console_find(uint8_t num)
+{
+	for (unsigned int i = 0; i < consoles_count; i++) {
+		if (consoles[i].num == num)
+			return &consoles[i];
+	}
+
+	return NULL;
+}
+
+int console_job_start(uint8_t num, int (*step)(uint8_t num, struct console_job *job),
+		      uint32_t arg, void *ptr)
+{
+	struct console *c = console_find(num);
+
+	if (!c)
+		return -1;
+
+	c->job.step = step;
+	c->job.pos = 0;
+	c->job.arg = arg;
+	c->job.ptr = ptr;
+	memset(c->job.state, 0, sizeof(c->job.state));
+
+	return 0;
+}
+
+static void console_job_finish(struct console *c)
+{
+	c->job.step = NULL;
+	usart_puts(c->num, "\n[console]# ");
+}
+
+const struct command *console_find_cmd(const char *name)
+{
+	unsigned int low = 0;
+	unsigned int high = __cmds_end - __cmds_start;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		int res = strcmp(name, __cmds_start[mid].cmd);
+
+		if (!res)
+			return &__cmds_start[mid];
+
+		if (res < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	return NULL;
+}
+
+// Returns -1 if error of real baudrate is too big
+static int baudrate_check(uint32_t pclk, uint32_t rate)
+{
+	uint32_t brr;
+	uint32_t real;
+	uint32_t error;
+
+	if (rate < 1200 || rate > pclk / 16)
+		return -1;
+
+	brr = (pclk + rate / 2) / rate;
+	real = pclk / brr;
+	error = real > rate ? real - rate : rate - real;
+
+	return (uint64_t)error * 1000 / rate > BAUDRATE_MAX_ERROR ? -1 : 0;
+}
+
+static void baudrate_confirm(struct console *c)
+{
+	if (!c->baudrate.is_pending)
+		return;
+
+	c->baudrate.is_pending = false;
+	if (c == &consoles[0])
+		env_baudrate = usart_get_baudrate(c->num, c->pclk);
+}
+
+static void baudrate_process(struct console *c)
+{
+	struct baudrate *b = &c->baudrate;
+
+	if (b->request) {
+		usart_set_baudrate(c->num, c->pclk, b->request);
+		b->request = 0;
+		b->is_pending = true;
+		b->switch_tick = HAL_GetTick();
+		b->proto_frames = c->proto.rx_frames;
+		return;
+	}
+
+	if (!b->is_pending)
+		return;
+
+	if (c->proto.rx_frames != b->proto_frames) {
+		baudrate_confirm(c);
+		return;
+	}
+
+	if (HAL_GetTick() - b->switch_tick > BAUDRATE_CONFIRM_TIMEOUT) {
+		b->is_pending = false;
+		if (c == &consoles[0])
+			env_baudrate = CONSOLE_BAUDRATE;
+		usart_set_baudrate(c->num, c->pclk, CONSOLE_BAUDRATE);
+		usart_printf(c->num, "\nBaudrate is not confirmed, returned to %u\n[console]# ", CONSOLE_BAUDRATE);
+	}
+}
+
+// One command per step
+static int help_step(uint8_t num, struct console_job *job)
+{
+	const struct command *cmd = &__cmds_start[job->pos++];
+
+	if (cmd == __cmds_start)
+		usart_printf(num, "Доступные команды:\n");
+
+	usart_printf(num, "  - %s", cmd->cmd);
+	for (int j = 0; j < cmd->arg_min; j++)
+		usart_printf(num, " <arg%d>", j + 1);
+
+	for (int j = cmd->arg_min; j < cmd->arg_max; j++)
+		usart_printf(num, " [arg%d]", j + 1);
+
+	usart_putc(num, '\n');
+	if (cmd->help)
+		print_help_text(num, cmd->help);
+
+	usart_putc(num, '\n');
+
+	return cmd + 1 < __cmds_end ? CONSOLE_JOB_AGAIN : CONSOLE_JOB_DONE;
+}
+
+static int cmd_help(uint8_t num, int argc, char *argv[])
+{
+	return console_job_start(num, help_step, 0, NULL);
+}
+CONSOLE_CMD(help, cmd_help, 0, 0, NULL);
+
+static int cmd_usart_info(uint8_t num, int argc, char *argv[])
+{
+	struct console *c = console_find(num);
+	struct usart_stats stats;
+
+	usart_get_stats(num, &stats);
+	usart_printf(num, "rx_overrun: %u\n", stats.overrun);
+	usart_printf(num, "rx_framing: %u\n", stats.framing);
+	usart_printf(num, "rx_noise:   %u\n", stats.noise);
+	usart_printf(num, "rx_dropped: %u\n", stats.dropped);
+	usart_printf(num, "tx_dropped: %u\n", stats.tx_dropped);
+	usart_printf(num, "proto_crc:  %u\n", c->proto.crc_errors);
+	usart_printf(num, "proto_cobs: %u\n", c->proto.frame_errors);
+
+	return 0;
+}
+CONSOLE_CMD(usart_info, cmd_usart_info, 0, 0, "вывести счётчики ошибок приёма UART и потерянных при передаче байт");
+
+static int cmd_baudrate(uint8_t num, int argc, char *argv[])
+{
+	struct console *c = console_find(num);
+	var_from_str(value, argv[0]);
+
+	if (baudrate_check(c->pclk, value)) {
+		usart_printf(num, "Error: Baudrate %u can't be set with pclk %u\n", value, c->pclk);
+		return -1;
+	}
+
+	usart_printf(num, "Switching to %u baud, send any command to confirm in %u ms\n",
+		     value, BAUDRATE_CONFIRM_TIMEOUT);
+	c->baudrate.request = value;
+
+	return 0;
+}
+CONSOLE_CMD(baudrate, cmd_baudrate, 1, 1, "изменить скорость консоли... arg1 - скорость (бод). Если в течении 5 секунд на новой скорости не придёт ни одной правильной команды, то вернётся скорость 115200");
+
+uint8_t console_proto_baudrate(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
+{
+	struct console *c = console_find(p->num);
+	uint32_t value;
+
+	memcpy(&value, req, sizeof(value));
+	if (baudrate_check(c->pclk, value))
+		return PROTO_ERR_ARG;
+
+	c->baudrate.request = value;
+
+	return PROTO_OK;
+}
+
+static void console_parse(struct console *c)
+{
+	uint8_t num = c->num;
+	const struct command *cmd;
+	char *args[5];
+	int argc = 0;
+	int size = strlen(c->line);
+	int pos = c->history_pos ? c->history_pos - 1 : ARRAY_SIZE(c->history) - 1;
+	bool last_space = false;
+
+	if (!size)
+		return;
+
+	if (strcmp(c->history[pos], c->line)) {
+		strncpy(c->history[c->history_pos++], c->line, sizeof(c->history[0]));
+		if (c->history_pos >= ARRAY_SIZE(c->history))
+			c->history_pos = 0;
+
+		if (c->history_size < ARRAY_SIZE(c->history))
+			c->history_size++;
+	}
+
+	for (int i = 0; i < size; i++) {
+		if (c->line[i] == ' ') {
+			c->line[i] = '\0';
+			last_space = true;
+		} else {
+			if (last_space) {
+				if (argc >= ARRAY_SIZE(args)) {
+					usart_puts(num, "Error: Too many arguments\n");
+					return;
+				}
+				args[argc++] = &c->line[i];
+				last_space = false;
+			}
+		}
+	}
+
+	cmd = console_find_cmd(c->line);
+	if (!cmd) {
+		usart_printf(num, "Error: Unknown command '%s'\n", c->line);
+		return;
+	}
+
+	if (argc < cmd->arg_min || argc > cmd->arg_max) {
+		usart_printf(num,
+			     "Error: Incorrect arguments count. Expected [%d..%d], but sended %d\n",
+			     cmd->arg_min,
+			     cmd->arg_max,
+			     argc);
+		return;
+	}
+
+	baudrate_confirm(c);
+	cmd->func(num, argc, args);
+}
+
+static void console_move_cursor(uint8_t num, int shift, bool to_left)
+{
+	char buf[6] = "\x1b[0\0\0\0";
+	char dir = to_left ? 'D' : 'C';
+
+	if (!shift)
+		return;
+	else if (shift > 99)
+		shift = 99;
+
+	if (shift < 10) {
+		buf[2] = shift + '0';
+		buf[3] = dir;
+	} else {
+		buf[2] = shift / 10 + '0';
+		buf[3] = shift % 10 + '0';
+		buf[4] = dir;
+	}
+
+	usart_puts(num, buf);
+}
+
+static void console_print_history(struct console *c)
+{
+	uint8_t num = c->num;
+	int len;
+	int pos;
+
+	if (c->history_sel) {
+		pos = c->history_sel;
+		if (pos > c->history_pos)
+			pos = ARRAY_SIZE(c->history) - (pos - c->history_pos);
+		else
+			pos = c->history_pos - pos;
+
+		strncpy(c->line, c->history[pos], sizeof(c->line));
+	} else {
+		c->line[0] = '\0';
+	}
+
+	len = strlen(c->line);
+	console_move_cursor(num, c->line_pos, true);
+	usart_puts(num, c->line);
+	if (len < c->line_pos) {
+		for (int i = 0; i < c->line_size - len; i++)
+			usart_putc(num, ' ');
+
+		console_move_cursor(num, c->line_size - len, true);
+	}
+	c->line_size = len;
+	c->line_pos = len;
+}
+
+static void console_process_one(struct console *c)
+{
+	uint8_t num = c->num;
+
+	while (usart_is_received(num)) {
+		uint8_t ch = usart_recv_byte(num);
+
+		if (c->proto.is_active) {
+			proto_recv_byte(&c->proto, ch);
+			continue;
+		}
+
+		if (monitor_is_active(num)) {
+			monitor_stop();
+			usart_puts(num, "[console]# ");
+			continue;
+		}
+
+		// Input is dropped while command is running, only Ctrl-C is handled
+		if (c->job.step) {
+			if (ch == 0x3) {
+				usart_puts(num, "^C\n");
+				console_job_finish(c);
+			}
+			continue;
+		}
+
+		if (proto_detect(&c->proto, ch)) {
+			baudrate_confirm(c);
+			// Drop start of magic sequence which was put into line
+			c->line_pos = 0;
+			c->line_size = 0;
+			c->line[0] = '\0';
+			c->is_esc_seq = false;
+			continue;
+		}
+
+		if (c->is_esc_seq) {
+			c->esc_seq = (c->esc_seq << 8) | ch;
+			if ((c->esc_seq_pos && ch >= 0x41) || c->esc_seq_pos > 4 || ch <= 0x20) {
+				c->is_esc_seq = false;
+				switch (c->esc_seq) {
+				case ESC_RIGHT:
+					if (c->line_pos < c->line_size) {
+						console_move_cursor(num, 1, false);
+						c->line_pos++;
+					}
+					break;
+				case ESC_LEFT:
+					if (c->line_pos) {
+						console_move_cursor(num, 1, true);
+						c->line_pos--;
+					}
+					break;
+				case ESC_HOME:
+				case ESC_HOME2:
+					if (c->line_pos) {
+						console_move_cursor(num, c->line_pos, true);
+						c->line_pos = 0;
+					}
+					break;
+				case ESC_END:
+				case ESC_END2:
+					if (c->line_pos < c->line_size) {
+						console_move_cursor(num, c->line_size - c->line_pos, false);
+						c->line_pos = c->line_size;
+					}
+					break;
+				case ESC_UP:
+					if (c->history_sel < c->history_size) {
+						c->history_sel++;
+						console_print_history(c);
+					}
+					break;
+				case ESC_DOWN:
+					if (c->history_sel > 0) {
+						c->history_sel--;
+						console_print_history(c);
+					}
+					break;
+				default:
+					// usart_printf(num, " escseq: %#x\n", c->esc_seq);
+					break;
+				}
+			} else {
+				c->esc_seq_pos++;
+			}
+
+			continue;
+		}
+
+		switch (ch) {
+		case 0x1b:  // Esc
+			c->is_esc_seq = true;
+			c->esc_seq = 0;
+			c->esc_seq_pos = 0;
+			break;
+		case 0x8:  // Backspace
+		case 0x7f:  // Backspace
+			if (c->line_pos) {
+				for (int i = c->line_pos; i < c->line_size + 1; i++)
+					c->line[i - 1] = c->line[i];
+
+				c->line_pos--;
+				c->line_size--;
+				c->line[c->line_size] = '\0';
+				console_move_cursor(num, 1, true);
+				usart_printf(num, "%s ", &c->line[c->line_pos]);
+				console_move_cursor(num, c->line_size - c->line_pos + 1, true);
+			}
+			break;
+		case 0x3:  // Ctrl-C
+			usart_puts(num, "^C\n[console]# ");
+			c->line_pos = 0;
+			c->line_size = 0;
+			c->line[0] = '\0';
+			c->history_sel = 0;
+			break;
+		case 0xd:
+			usart_printf(num, "\n");
+			console_parse(c);
+			// Prompt is printed when monitor is stopped or job is done
+			if (!monitor_is_active(num) && !c->job.step)
+				usart_printf(num, "\n[console]# ");
+			c->line_pos = 0;
+			c->line_size = 0;
+			c->line[0] = '\0';
+			c->history_sel = 0;
+		case 0xa:
+			break;
+		default:
+			if (c->line_size < (sizeof(c->line) - 2)) {
+				for (int i = c->line_size; i >= c->line_pos; i--)
+					c->line[i + 1] = c->line[i];
+
+				c->line[c->line_pos] = ch;
+				usart_puts(num, &c->line[c->line_pos]);
+				console_move_cursor(num, c->line_size - c->line_pos, true);
+				c->line_size++;
+				c->line_pos++;
+			}
+			break;
+		}
+	}
+
+	if (c->job.step && usart_get_tx_free(num) >= CONSOLE_JOB_TX_SPACE) {
+		if (c->job.step(num, &c->job) != CONSOLE_JOB_AGAIN)
+			console_job_finish(c);
+	}
+}
+
+void console_process(void)
+{
+	for (unsigned int i = 0; i < consoles_count; i++) {
+		console_process_one(&consoles[i]);
+		proto_process(&consoles[i].proto);
+		baudrate_process(&consoles[i]);
+	}
+}
+
+void console_init(struct console *c, unsigned int count,
+		  const struct proto_handler *handlers, unsigned int handlers_count)
+{
+	consoles = c;
+	consoles_count = count;
+	for (unsigned int i = 0; i < count; i++)
+		proto_init(&c[i].proto, c[i].num, handlers, handlers_count);
+}
+
+void console_apply_env(void)
+{
+	uint8_t num = consoles[0].num;
+
+	for (unsigned int i = 0; i < consoles_count; i++)
+		usart_set_tx_policy(consoles[i].num, env_tx_policy);
+
+	if (env_baudrate == CONSOLE_BAUDRATE)
+		return;
+
+	if (baudrate_check(consoles[0].pclk, env_baudrate)) {
+		usart_printf(num, "Wrong baudrate %u in environment\n", env_baudrate);
+		env_baudrate = CONSOLE_BAUDRATE;
+	} else {
+		// Saved baudrate may be unusable with this host: it is confirmed as by command
+		usart_printf(num, "Switching to %u baud, send any command to confirm in %u ms\n",
+			     env_baudrate, BAUDRATE_CONFIRM_TIMEOUT);
+		consoles[0].baudrate.request = env_baudrate;
+	}
+}
@@ -0,0 +1,107 @@
+#ifndef _CONSOLE_H
+#define _CONSOLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "proto.h"
+
+#define CONSOLE_BAUDRATE		115200  // after reset and when new baudrate is not confirmed
+#define BAUDRATE_CONFIRM_TIMEOUT	5000  // ms
+#define BAUDRATE_MAX_ERROR		20  // 1/1000 of requested baudrate
+// Job step is called only when transmit buffer has this free space, so its output never waits
+#define CONSOLE_JOB_TX_SPACE		384
+
+// Result of job step
+#define CONSOLE_JOB_DONE	0
+#define CONSOLE_JOB_AGAIN	1  // call again on the next pass of main loop
+
+struct command {
+	const char *cmd;
+	int (*func)(uint8_t num, int argc, char *argv[]);
+	uint8_t arg_min;
+	uint8_t arg_max;
+	const char *help;
+};
+
+// Registers command from any file. Commands of all files are collected by linker into one table
+// sorted by name (see .cmds in linker script), so they are found by binary search
+#define CONSOLE_CMD(_name, _func, _min, _max, _help) \
+	static const struct command __cmd_##_name \
+	__attribute__((used, section(".cmds." #_name), aligned(4))) = { \
+		.cmd = #_name, \
+		.func = _func, \
+		.arg_min = _min, \
+		.arg_max = _max, \
+		.help = _help, \
+	}
+
+#define var_from_str(v, argv) uint32_t v; \
+	do { \
+		bool ok; \
+		v = str_to_uint32(argv, &ok); \
+		if (!ok) { \
+			usart_printf(num, "Error: Argument '%s' is not an integer\n", argv); \
+			return -1; \
+		} \
+	} while (0)
+
+// Baudrate change is confirmed by any correct command or frame at new baudrate
+struct baudrate {
+	uint32_t request;  // switch after response is sent
+	uint32_t switch_tick;
+	uint32_t proto_frames;
+	bool is_pending;
+};
+
+// Long command is split into steps: every step does bounded work or output and the main loop
+// keeps running between them. Ctrl-C cancels the job
+struct console_job {
+	// Returns CONSOLE_JOB_AGAIN, CONSOLE_JOB_DONE or negative on error
+	int (*step)(uint8_t num, struct console_job *job);
+	uint32_t pos;  // progress of job, 0 before the first step
+	uint32_t arg;
+	void *ptr;
+	uint32_t state[16];  // own state of job between steps, zeroed at start
+};
+
+// Every USART has own console with binary protocol
+struct console {
+	uint8_t num;
+	uint32_t pclk;
+	struct proto proto;
+	struct baudrate baudrate;
+	struct console_job job;
+	char line[64];
+	char history[4][64];
+	int line_pos;
+	int line_size;
+	int history_pos;
+	int history_size;
+	int history_sel;
+	bool is_esc_seq;
+	uint32_t esc_seq;
+	unsigned int esc_seq_pos;
+};
+
+uint32_t str_to_uint32(char *s, bool *ok);
+
+// The first console is the main one: it gets boot messages and baudrate from environment.
+// USARTs must be initialized before
+void console_init(struct console *consoles, unsigned int count,
+		  const struct proto_handler *handlers, unsigned int handlers_count);
+// Apply tx_policy and baudrate variables after environment is loaded
+void console_apply_env(void);
+struct console *console_find(uint8_t num);
+// Called by command instead of doing the work itself. The first step is called on the next pass
+// of main loop. Prompt is printed when the job is done
+int console_job_start(uint8_t num, int (*step)(uint8_t num, struct console_job *job),
+		      uint32_t arg, void *ptr);
+const struct command *console_find_cmd(const char *name);
+// Called from main loop: handles received data of all consoles
+void console_process(void);
+
+// Handler of PROTO_MSG_BAUDRATE
+uint8_t console_proto_baudrate(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+
+#endif  // _CONSOLE_H
@@ -0,0 +1,26 @@
+#ifndef _CRC_H
+#define _CRC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// CRC-32 unit: polynomial 0x04c11db7, initial value 0xffffffff, data is fed by 32-bit words
+// without reflection and final xor (so it is not the same as CRC-32 of zlib). Data must be aligned
+// to 4 bytes, length is in words
+#define CRC_DMA_CH	6
+#define CRC_MAX_WORDS	0xffff  // one DMA transfer
+#define CRC_INIT	0xffffffff  // value after reset of unit
+
+void crc_init(void);
+// Blocking calculation, waits for asynchronous one. Only for main loop
+uint32_t crc_calc(const void *data, unsigned int words);
+// Continues calculation from crc returned for previous data (CRC_INIT to start), so long data can
+// be fed in parts while unit is shared with other users between them
+uint32_t crc_update(uint32_t crc, const void *data, unsigned int words);
+// DMA feeds unit from memory while CPU runs, done is called from DMA interrupt with res 0 or -1.
+// Returns -1 if unit is busy
+int crc_calc_async(const void *data, unsigned int words, void (*done)(uint32_t crc, int res, void *arg),
+		   void *arg);
+bool crc_is_busy(void);
+
+#endif  // _CRC_H
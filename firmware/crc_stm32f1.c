@@ -0,0 +1,102 @@
+#include <stdint.h>
+
+#include <common.h>
+#include <crc.h>
+#include <dma.h>
+#include <nvic.h>
+
+#define CRC_BASE_ADDR 0x40023000
+
+#define REG_DR		(CRC_BASE_ADDR + 0)
+#define REG_IDR		(CRC_BASE_ADDR + 0x4)
+#define REG_CR		(CRC_BASE_ADDR + 0x8)
+
+#define CR_RESET	BIT(0)
+
+#define CRC_POLY	0x04c11db7
+
+struct crc_async {
+	void (*done)(uint32_t crc, int res, void *arg);
+	void *arg;
+	volatile bool is_busy;
+};
+
+static struct crc_async crc_async;
+
+void crc_init(void)
+{
+	nvic_enable_irq(IRQ_DMA1_CH1 + CRC_DMA_CH - 1);
+}
+
+// Unit can't be loaded with value, so find word which turns CRC_INIT into crc: undo 32 shifts of
+// polynomial division (low bit tells whether polynomial was subtracted) and xor with CRC_INIT
+static uint32_t crc_unshift(uint32_t crc)
+{
+	for (int i = 0; i < 32; i++)
+		crc = (crc & 1) ? ((crc ^ CRC_POLY) >> 1) | 0x80000000 : crc >> 1;
+
+	return crc ^ CRC_INIT;
+}
+
+uint32_t crc_update(uint32_t crc, const void *data, unsigned int words)
+{
+	const uint32_t *p = data;
+
+	while (crc_async.is_busy) {
+	}
+
+	writel(CR_RESET, REG_CR);
+	if (crc != CRC_INIT)
+		writel(crc_unshift(crc), REG_DR);
+
+	// Unit delays write to DR while previous word is calculated
+	for (unsigned int i = 0; i < words; i++)
+		writel(p[i], REG_DR);
+
+	return readl(REG_DR);
+}
+
+uint32_t crc_calc(const void *data, unsigned int words)
+{
+	return crc_update(CRC_INIT, data, words);
+}
+
+int crc_calc_async(const void *data, unsigned int words, void (*done)(uint32_t crc, int res, void *arg),
+		   void *arg)
+{
+	if (crc_async.is_busy || words > CRC_MAX_WORDS)
+		return -1;
+
+	writel(CR_RESET, REG_CR);
+	if (!words) {
+		done(readl(REG_DR), 0, arg);
+		return 0;
+	}
+
+	crc_async.done = done;
+	crc_async.arg = arg;
+	crc_async.is_busy = true;
+	// Memory to memory: "peripheral" is source in memory, "memory" is DR of unit
+	dma_start(CRC_DMA_CH, (uintptr_t)data, REG_DR, words,
+		  DMA_MEM2MEM | DMA_PERIPH_INC | DMA_PSIZE_32 | DMA_MSIZE_32 | DMA_IRQ_TC | DMA_IRQ_TE);
+
+	return 0;
+}
+
+bool crc_is_busy(void)
+{
+	return crc_async.is_busy;
+}
+
+void DMA1_Channel6_IRQHandler(void)
+{
+	uint32_t flags = dma_get_flags(CRC_DMA_CH);
+
+	dma_clear_flags(CRC_DMA_CH, flags);
+	if (!(flags & (DMA_FLAG_TC | DMA_FLAG_TE)) || !crc_async.is_busy)
+		return;
+
+	dma_stop(CRC_DMA_CH);
+	crc_async.is_busy = false;
+	crc_async.done(readl(REG_DR), (flags & DMA_FLAG_TE) ? -1 : 0, crc_async.arg);
+}
@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 void delay_init(void);
+uint32_t get_tick(void);  // CPU cycles counter
+uint32_t tick2us(uint32_t tick);
 void delay_us(uint32_t us);
 void delay_ms(uint32_t ms);
 
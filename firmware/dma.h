@@ -0,0 +1,40 @@
+#ifndef _DMA_H
+#define _DMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#ifdef STM32F1
+#define DMA_IRQ_TC BIT(1)  // hardware depended value
+#define DMA_IRQ_HT BIT(2)  // hardware depended value
+#define DMA_IRQ_TE BIT(3)  // hardware depended value
+#define DMA_FROM_MEM BIT(4)  // hardware depended value
+#define DMA_CIRC BIT(5)  // hardware depended value
+#define DMA_PERIPH_INC BIT(6)  // hardware depended value
+#define DMA_MEM_INC BIT(7)  // hardware depended value
+#define DMA_PSIZE_8 0  // hardware depended value
+#define DMA_PSIZE_16 BIT(8)  // hardware depended value
+#define DMA_PSIZE_32 BIT(9)  // hardware depended value
+#define DMA_MSIZE_8 0  // hardware depended value
+#define DMA_MSIZE_16 BIT(10)  // hardware depended value
+#define DMA_MSIZE_32 BIT(11)  // hardware depended value
+#define DMA_PRIO_LOW 0  // hardware depended value
+#define DMA_PRIO_MEDIUM BIT(12)  // hardware depended value
+#define DMA_PRIO_HIGH BIT(13)  // hardware depended value
+#define DMA_MEM2MEM BIT(14)  // hardware depended value
+
+#define DMA_FLAG_TC BIT(1)
+#define DMA_FLAG_HT BIT(2)
+#define DMA_FLAG_TE BIT(3)
+#endif
+
+// Only DMA1 is supported, channels are numbered from 1
+void dma_start(uint8_t ch, uintptr_t periph, uintptr_t mem, uint16_t len, uint32_t flags);
+void dma_stop(uint8_t ch);
+uint16_t dma_get_remaining(uint8_t ch);
+uint32_t dma_get_flags(uint8_t ch);
+void dma_clear_flags(uint8_t ch, uint32_t flags);
+
+#endif  // _DMA_H
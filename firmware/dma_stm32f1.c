@@ -0,0 +1,60 @@
+#include "common.h"
+#include "dma.h"
+
+#define DMA1_BASE_ADDR 0x40020000
+
+#define REG_ISR		(DMA1_BASE_ADDR + 0)
+#define REG_IFCR	(DMA1_BASE_ADDR + 0x4)
+
+#define CCR_EN BIT(0)
+
+#define FLAGS_MASK (DMA_FLAG_TC | DMA_FLAG_HT | DMA_FLAG_TE)
+
+typedef struct {
+	volatile uint32_t CCR;
+	volatile uint32_t CNDTR;
+	volatile uint32_t CPAR;
+	volatile uint32_t CMAR;
+	volatile uint32_t reserved;
+} dma_channel_regs_t;
+
+static dma_channel_regs_t *get_dma_channel_regs(uint8_t ch)
+{
+	return (dma_channel_regs_t *)(DMA1_BASE_ADDR + 0x8 + (ch - 1) * 0x14);
+}
+
+void dma_start(uint8_t ch, uintptr_t periph, uintptr_t mem, uint16_t len, uint32_t flags)
+{
+	dma_channel_regs_t *regs = get_dma_channel_regs(ch);
+
+	regs->CCR = 0;
+	dma_clear_flags(ch, FLAGS_MASK);
+	regs->CPAR = periph;
+	regs->CMAR = mem;
+	regs->CNDTR = len;
+	regs->CCR = flags | CCR_EN;
+}
+
+void dma_stop(uint8_t ch)
+{
+	dma_channel_regs_t *regs = get_dma_channel_regs(ch);
+
+	regs->CCR &= ~CCR_EN;
+}
+
+uint16_t dma_get_remaining(uint8_t ch)
+{
+	dma_channel_regs_t *regs = get_dma_channel_regs(ch);
+
+	return regs->CNDTR;
+}
+
+uint32_t dma_get_flags(uint8_t ch)
+{
+	return (readl(REG_ISR) >> ((ch - 1) * 4)) & FLAGS_MASK;
+}
+
+void dma_clear_flags(uint8_t ch, uint32_t flags)
+{
+	writel((flags & FLAGS_MASK) << ((ch - 1) * 4), REG_IFCR);
+}
@@ -0,0 +1,680 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "console.h"
+#include "crc.h"
+#include "env.h"
+#include "flash.h"
+#include "proto.h"
+#include "usart.h"
+
+// Sorted by name (see linker script)
+extern const struct env_var __env_start[];
+extern const struct env_var __env_end[];
+extern const struct env_check __env_check_start[];
+extern const struct env_check __env_check_end[];
+
+unsigned int env_count(void)
+{
+	return __env_end - __env_start;
+}
+
+const struct env_var *env_get(unsigned int index)
+{
+	return index < env_count() ? &__env_start[index] : NULL;
+}
+
+const struct env_var *env_find(const char *name)
+{
+	unsigned int low = 0;
+	unsigned int high = env_count();
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		int res = strcmp(name, __env_start[mid].name);
+
+		if (!res)
+			return &__env_start[mid];
+
+		if (res < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+
+	return NULL;
+}
+
+// Returns error text of the first failed check
+static const char *env_run_checks(void)
+{
+	for (const struct env_check *c = __env_check_start; c < __env_check_end; c++) {
+		const char *err = c->func();
+
+		if (err)
+			return err;
+	}
+
+	return NULL;
+}
+
+const char *env_set(const struct env_var *e, uint32_t value)
+{
+	uint32_t prev = *e->value;
+	const char *err;
+
+	if (value < e->min || value > e->max)
+		return "value is out of range";
+
+	*e->value = value;
+	err = env_run_checks();
+	if (err)
+		*e->value = prev;
+
+	return err;
+}
+
+// Saved value of every slot, the same as in the last committed record of this slot in log
+static uint32_t saved[ENV_SLOTS];
+static uint32_t saved_mask;
+// Page where records are appended (0 if log is empty) and address of the next record there
+static uintptr_t log_page;
+static uintptr_t log_pos;
+static uint32_t log_seq;
+
+// Flash operation of save or delete, data is NULL for page erase
+struct env_op {
+	uintptr_t addr;
+	const void *data;
+	unsigned int len;
+	uint8_t flags;  // ENV_OP_*
+};
+
+#define ENV_OP_OPEN	BIT(0)  // opens new page: log position is restored if it fails
+#define ENV_OP_COMMIT	BIT(1)  // batch of env_save: values are saved when it is programmed
+// Erase and header of new page, copy of values, erase of other pages and batch
+#define ENV_OPS_MAX	(ENV_LOG_PAGES + 4)
+
+// Operations are planned in main loop and done one by one by flash jobs
+struct env_writer {
+	struct flash_job job;
+	struct env_op ops[ENV_OPS_MAX];
+	unsigned int count;
+	unsigned int pos;
+	struct env_page_header hdr;
+	struct env_record copy[ENV_SLOTS + 1];  // all saved values on compaction, with commit
+	struct env_record batch[ENV_SLOTS + 1];  // changed values, with commit
+	unsigned int batch_count;
+	uintptr_t end;  // after the last programmed records
+	uintptr_t prev_page;  // log position before save to restore if new page can't be opened
+	uintptr_t prev_pos;
+	uint32_t prev_seq;
+	uint32_t version;  // of page where batches are planned
+	volatile int status;  // 1 while jobs are running, then 0 or -1
+};
+
+static struct env_writer writer;
+
+static void env_job_done(struct flash_job *job, int res);
+
+static uint16_t env_record_check(struct env_record *rec)
+{
+	return ~(rec->slot + (rec->value & 0xffff) + (rec->value >> 16));
+}
+
+static bool env_is_blank(uintptr_t addr, unsigned int len)
+{
+	for (unsigned int pos = 0; pos < len; pos += 4) {
+		if (readl(addr + pos) != 0xffffffff)
+			return false;
+	}
+
+	return true;
+}
+
+static bool env_page_is_used(uintptr_t page)
+{
+	struct env_page_header *hdr = (struct env_page_header *)page;
+
+	return hdr->magic == ENV_LOG_MAGIC && hdr->seq_check == (uint32_t)~hdr->seq;
+}
+
+static uintptr_t env_next_page(uintptr_t page)
+{
+	if (!page || page + ENV_PAGE_SIZE >= ENV_LOG_ADDR + ENV_LOG_PAGES * ENV_PAGE_SIZE)
+		return ENV_LOG_ADDR;
+
+	return page + ENV_PAGE_SIZE;
+}
+
+// Converts value saved by older firmware in place. Returns false if value must be dropped.
+// Slots are never reused, so a variable with changed meaning gets new slot and its old slot is
+// converted here
+static bool env_migrate(uint32_t version, uint16_t *slot, uint32_t *value)
+{
+	switch (version) {
+	case 0:
+		// Environment of old firmware has the same slots and values without range checks:
+		// they are checked by env_load() as all other values
+	default:
+		break;
+	}
+
+	return *slot < ENV_SLOTS;
+}
+
+static void env_saved_set(uint32_t version, uint16_t slot, uint32_t value)
+{
+	if (!env_migrate(version, &slot, &value))
+		return;
+
+	saved[slot] = value;
+	saved_mask |= BIT(slot);
+}
+
+static uint16_t env_batch_crc(uint32_t version, const struct env_record *batch, unsigned int count)
+{
+	if (version < 2)
+		return proto_crc16(0xffff, (uint8_t *)batch, count * sizeof(*batch));
+
+	return crc_calc(batch, count * sizeof(*batch) / 4) & 0xffff;
+}
+
+// Records of batch are right before its commit record
+static bool env_batch_is_valid(uintptr_t page, uintptr_t addr, struct env_record *commit)
+{
+	uint32_t version = ((struct env_page_header *)page)->version;
+	uint16_t count = commit->value & 0xffff;
+	uint16_t crc = commit->value >> 16;
+	uintptr_t start = addr - count * sizeof(struct env_record);
+
+	if (commit->check != env_record_check(commit) || !count || count > ENV_SLOTS)
+		return false;
+
+	if (start < page + sizeof(struct env_page_header))
+		return false;
+
+	return crc == env_batch_crc(version, (struct env_record *)start, count);
+}
+
+// Applies committed batches of page in place. Returns address after the last record.
+// Failed program can leave blank records before the next batch, so the whole page is scanned
+static uintptr_t env_page_replay(uintptr_t page, unsigned int *commits)
+{
+	uintptr_t addr = page + sizeof(struct env_page_header);
+	uintptr_t end = addr;
+	uint32_t version = ((struct env_page_header *)page)->version;
+
+	*commits = 0;
+	for (; addr < page + ENV_PAGE_SIZE; addr += sizeof(struct env_record)) {
+		struct env_record *rec = (struct env_record *)addr;
+		uint16_t count;
+
+		if (env_is_blank(addr, sizeof(*rec)))
+			continue;
+
+		end = addr + sizeof(*rec);
+
+		// Records of batch without commit (power loss during save) are never applied
+		if (rec->slot != ENV_SLOT_COMMIT || !env_batch_is_valid(page, addr, rec))
+			continue;
+
+		count = rec->value & 0xffff;
+		for (struct env_record *r = rec - count; r < rec; r++)
+			env_saved_set(version, r->slot, r->value);
+
+		(*commits)++;
+	}
+
+	return end;
+}
+
+// Environment of old firmware: the whole page of values ordered by slot
+static int env_load_legacy(void)
+{
+	uint32_t len;
+
+	if (readl(ENV_ADDR) != ENV_MAGIC)
+		return -1;
+
+	len = readl(ENV_ADDR + 0x4);
+	if (len > ENV_SLOTS)
+		len = ENV_SLOTS;
+
+	for (uint32_t slot = 0; slot < len; slot++)
+		env_saved_set(0, slot, readl(ENV_ADDR + 0x10 + (slot * 0x4)));
+
+	return 0;
+}
+
+int env_load(void)
+{
+	uintptr_t prev_page = 0;
+	uint32_t prev_seq = 0;
+	unsigned int commits = 0;
+	uint32_t seq = 0;
+
+	if (writer.status > 0)
+		return -1;
+
+	saved_mask = 0;
+	log_page = 0;
+	log_pos = 0;
+	log_seq = 0;
+
+	// Pages are replayed from the oldest one, so later records override earlier
+	while (1) {
+		uintptr_t page = 0;
+		uint32_t page_seq = 0xffffffff;
+
+		for (int i = 0; i < ENV_LOG_PAGES; i++) {
+			uintptr_t addr = ENV_LOG_ADDR + i * ENV_PAGE_SIZE;
+			struct env_page_header *hdr = (struct env_page_header *)addr;
+
+			if (env_page_is_used(addr) && hdr->seq > seq && hdr->seq <= page_seq) {
+				page = addr;
+				page_seq = hdr->seq;
+			}
+		}
+
+		if (!page)
+			break;
+
+		prev_page = log_page;
+		prev_seq = log_seq;
+		seq = page_seq;
+		log_page = page;
+		log_seq = page_seq;
+		log_pos = env_page_replay(page, &commits);
+	}
+
+	// Compaction was interrupted before its copy of values was committed: the new page is
+	// dropped, so the next compaction can't erase old pages which still hold the values
+	if (log_page && !commits) {
+		if (flash_erase_page(log_page))
+			return -1;
+
+		log_page = prev_page;
+		log_seq = prev_seq;
+		log_pos = prev_page ? prev_page + ENV_PAGE_SIZE : 0;
+	}
+
+	if (!log_page && !saved_mask && env_load_legacy())
+		return -1;
+
+	for (const struct env_var *e = __env_start; e < __env_end; e++) {
+		uint32_t value = saved[e->slot];
+
+		if ((saved_mask & BIT(e->slot)) && value >= e->min && value <= e->max)
+			*e->value = value;
+		else
+			*e->value = e->def;
+	}
+
+	if (env_run_checks()) {
+		for (const struct env_var *e = __env_start; e < __env_end; e++)
+			*e->value = e->def;
+
+		return -1;
+	}
+
+	// Values of old firmware are not in log: the first save copies all of them, because the old
+	// page is not read any more when log is not empty
+	if (!log_page)
+		saved_mask = 0;
+
+	return 0;
+}
+
+static void env_add_op(uintptr_t addr, const void *data, unsigned int len, uint8_t flags)
+{
+	struct env_op *op = &writer.ops[writer.count++];
+
+	op->addr = addr;
+	op->data = data;
+	op->len = len;
+	op->flags = flags;
+}
+
+// Batch is applied by load only after its commit record is programmed, so save is atomic.
+// Commit record is put into batch[count]
+static void env_plan_batch(struct env_record *batch, unsigned int count, uint8_t flags)
+{
+	struct env_record *commit = &batch[count];
+	unsigned int len = count * sizeof(*batch);
+
+	for (unsigned int i = 0; i < count; i++)
+		batch[i].check = env_record_check(&batch[i]);
+
+	// Batch can be appended to page written by older firmware
+	commit->slot = ENV_SLOT_COMMIT;
+	commit->value = count | (env_batch_crc(writer.version, batch, count) << 16);
+	commit->check = env_record_check(commit);
+
+	env_add_op(log_pos, batch, len + sizeof(*commit), flags);
+	log_pos += len + sizeof(*commit);
+}
+
+// One page is always kept erased. When it is the only one left, all saved values are copied
+// into it as one batch and only after its commit other pages are erased. Power loss at any point
+// keeps the previous values
+static void env_plan_next_page(void)
+{
+	uintptr_t page = env_next_page(log_page);
+	bool is_compact = env_page_is_used(env_next_page(page));
+	unsigned int count = 0;
+
+	if (!env_is_blank(page, ENV_PAGE_SIZE))
+		env_add_op(page, NULL, 0, ENV_OP_OPEN);
+
+	writer.hdr.magic = ENV_LOG_MAGIC;
+	writer.hdr.seq = log_seq + 1;
+	writer.hdr.seq_check = ~(log_seq + 1);
+	writer.hdr.version = ENV_VERSION;
+	env_add_op(page, &writer.hdr, sizeof(writer.hdr), ENV_OP_OPEN);
+	writer.version = ENV_VERSION;
+
+	log_page = page;
+	log_pos = page + sizeof(writer.hdr);
+	log_seq = writer.hdr.seq;
+	if (!is_compact)
+		return;
+
+	for (uint8_t slot = 0; slot < ENV_SLOTS; slot++) {
+		if (saved_mask & BIT(slot)) {
+			writer.copy[count].slot = slot;
+			writer.copy[count].value = saved[slot];
+			count++;
+		}
+	}
+
+	if (count)
+		env_plan_batch(writer.copy, count, 0);
+
+	for (uintptr_t addr = env_next_page(page); addr != page; addr = env_next_page(addr)) {
+		if (!env_is_blank(addr, ENV_PAGE_SIZE))
+			env_add_op(addr, NULL, 0, 0);
+	}
+}
+
+static int env_submit(void)
+{
+	struct env_op *op = &writer.ops[writer.pos];
+
+	writer.job.type = op->data ? FLASH_JOB_PROGRAM : FLASH_JOB_ERASE;
+	writer.job.addr = op->addr;
+	writer.job.data = op->data;
+	writer.job.len = op->len;
+	writer.job.done = env_job_done;
+
+	return flash_job_submit(&writer.job);
+}
+
+// Called from flash interrupt: the next operation is started only if this one succeeded
+static void env_job_done(struct flash_job *job, int res)
+{
+	struct env_op *op = &writer.ops[writer.pos];
+
+	if (op->data)
+		writer.end = op->addr + op->len;
+
+	if (res) {
+		if (op->flags & ENV_OP_OPEN) {
+			log_page = writer.prev_page;
+			log_pos = writer.prev_pos;
+			log_seq = writer.prev_seq;
+		} else {
+			// Failed batch is left in log and ignored by load, the next one goes after it
+			log_pos = writer.end;
+		}
+
+		writer.status = -1;
+		return;
+	}
+
+	if (op->flags & ENV_OP_COMMIT) {
+		for (unsigned int i = 0; i < writer.batch_count; i++) {
+			saved[writer.batch[i].slot] = writer.batch[i].value;
+			saved_mask |= BIT(writer.batch[i].slot);
+		}
+	}
+
+	writer.pos++;
+	if (writer.pos == writer.count)
+		writer.status = 0;
+	else if (env_submit())
+		writer.status = -1;
+}
+
+static void env_plan_start(void)
+{
+	writer.count = 0;
+	writer.pos = 0;
+	writer.prev_page = log_page;
+	writer.prev_pos = log_pos;
+	writer.prev_seq = log_seq;
+	writer.end = log_pos;
+	writer.version = log_page ? ((struct env_page_header *)log_page)->version : ENV_VERSION;
+}
+
+static int env_run(void)
+{
+	if (!writer.count) {
+		writer.status = 0;
+		return 0;
+	}
+
+	writer.status = 1;
+	if (!env_submit())
+		return 0;
+
+	log_page = writer.prev_page;
+	log_pos = writer.prev_pos;
+	log_seq = writer.prev_seq;
+	writer.status = -1;
+
+	return -1;
+}
+
+// Changed values are appended to log as one batch
+int env_save(void)
+{
+	unsigned int count = 0;
+
+	if (writer.status > 0)
+		return -1;
+
+	for (const struct env_var *e = __env_start; e < __env_end; e++) {
+		if ((saved_mask & BIT(e->slot)) && saved[e->slot] == *e->value)
+			continue;
+
+		writer.batch[count].slot = e->slot;
+		writer.batch[count].value = *e->value;
+		count++;
+	}
+
+	env_plan_start();
+	writer.batch_count = count;
+	if (count) {
+		if (!log_page || log_pos + (count + 1) * sizeof(struct env_record) > log_page + ENV_PAGE_SIZE)
+			env_plan_next_page();
+
+		env_plan_batch(writer.batch, count, ENV_OP_COMMIT);
+	}
+
+	return env_run();
+}
+
+int env_delete(void)
+{
+	if (writer.status > 0)
+		return -1;
+
+	env_plan_start();
+	for (int i = 0; i < ENV_LOG_PAGES; i++) {
+		uintptr_t page = ENV_LOG_ADDR + i * ENV_PAGE_SIZE;
+
+		if (!env_is_blank(page, ENV_PAGE_SIZE))
+			env_add_op(page, NULL, 0, 0);
+	}
+
+	if (!env_is_blank(ENV_ADDR, ENV_PAGE_SIZE))
+		env_add_op(ENV_ADDR, NULL, 0, 0);
+
+	if (env_run())
+		return -1;
+
+	saved_mask = 0;
+	log_page = 0;
+	log_pos = 0;
+	writer.end = 0;
+
+	return 0;
+}
+
+int env_status(void)
+{
+	return writer.status;
+}
+
+uint8_t env_proto_get(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
+{
+	const struct env_var *e = env_get(req[0]);
+	struct proto_env rec = { 0 };
+
+	if (!e)
+		return PROTO_ERR_ARG;
+
+	rec.index = req[0];
+	rec.value = *e->value;
+	strncpy(rec.name, e->name, sizeof(rec.name));
+	memcpy(resp, &rec, sizeof(rec));
+	*resp_len = sizeof(rec);
+
+	return PROTO_OK;
+}
+
+uint8_t env_proto_set(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
+{
+	const struct env_var *e = env_get(req[0]);
+	uint32_t value;
+
+	if (!e)
+		return PROTO_ERR_ARG;
+
+	memcpy(&value, &req[1], sizeof(value));
+
+	return env_set(e, value) ? PROTO_ERR_ARG : PROTO_OK;
+}
+
+uint8_t env_proto_save(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
+{
+	if (env_save())
+		return PROTO_ERR_FAIL;
+
+	// Response carries result, so request waits for flash jobs of save
+	while (writer.status > 0) {
+	}
+
+	return writer.status ? PROTO_ERR_FAIL : PROTO_OK;
+}
+
+void env_print(uint8_t num, const char *name)
+{
+	for (const struct env_var *e = __env_start; e < __env_end; e++) {
+		if (name && strcmp(name, e->name))
+			continue;
+
+		usart_printf(num, "%s : %u", e->name, *e->value);
+		if (e->unit)
+			usart_printf(num, " %s", e->unit);
+
+		if (e->type == ENV_TYPE_BOOL)
+			usart_printf(num, "  [0/1]");
+		else
+			usart_printf(num, "  [%u..%u]", e->min, e->max);
+
+		usart_printf(num, "  (%s)\n", e->help);
+	}
+}
+
+static int cmd_printenv(uint8_t num, int argc, char *argv[])
+{
+	env_print(num, argc ? argv[0] : NULL);
+
+	return 0;
+}
+CONSOLE_CMD(printenv, cmd_printenv, 0, 1, "вывести все переменные окружения (если arg1 не указан) или вывести переменную, указанную в arg1");
+
+static int cmd_setenv(uint8_t num, int argc, char *argv[])
+{
+	const struct env_var *e = env_find(argv[0]);
+	var_from_str(value, argv[1]);
+	const char *err;
+
+	if (!e) {
+		usart_printf(num, "Error: Environment variable '%s' is not found\n", argv[0]);
+		return -1;
+	}
+
+	err = env_set(e, value);
+	if (err) {
+		usart_printf(num, "Error: %s: %s\n", e->name, err);
+		return -1;
+	}
+
+	return 0;
+}
+CONSOLE_CMD(setenv, cmd_setenv, 2, 2, "указать новое целочисленное значение arg1 для переменной окружения arg1");
+
+// Waits for flash jobs of env_save or env_delete, job->ptr is error message
+static int env_wait_step(uint8_t num, struct console_job *job)
+{
+	if (writer.status > 0)
+		return CONSOLE_JOB_AGAIN;
+
+	if (writer.status) {
+		usart_puts(num, job->ptr);
+		return -1;
+	}
+
+	return CONSOLE_JOB_DONE;
+}
+
+static int cmd_saveenv(uint8_t num, int argc, char *argv[])
+{
+	char *err = "Error: Failed to save environment\n";
+
+	if (env_save()) {
+		usart_puts(num, err);
+		return -1;
+	}
+
+	return console_job_start(num, env_wait_step, 0, err);
+}
+CONSOLE_CMD(saveenv, cmd_saveenv, 0, 0, "сохранить все переменные окружения во внутреннюю Flash-память");
+
+static int cmd_loadenv(uint8_t num, int argc, char *argv[])
+{
+	if (env_load()) {
+		usart_puts(num, "Error: Failed to load environment\n");
+		return -1;
+	}
+
+	return 0;
+}
+CONSOLE_CMD(loadenv, cmd_loadenv, 0, 0, "загрузить ранее сохранённые переменные окружения");
+
+static int cmd_delenv(uint8_t num, int argc, char *argv[])
+{
+	char *err = "Error: Failed to clear environment\n";
+
+	if (env_delete()) {
+		usart_puts(num, err);
+		return -1;
+	}
+
+	return console_job_start(num, env_wait_step, 0, err);
+}
+CONSOLE_CMD(delenv, cmd_delenv, 0, 0, "очистить сохранённые переменные окружения во Flash-памяти... после перезагрузки будут использоваться занчения по умолчанию");
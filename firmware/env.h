@@ -0,0 +1,136 @@
+#ifndef _ENV_H
+#define _ENV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "proto.h"
+
+#define ENV_PAGE_SIZE	0x400
+
+// Values are saved as log of records in several pages before position page
+#define ENV_LOG_ADDR	0x0801e800
+#define ENV_LOG_PAGES	4
+#define ENV_LOG_MAGIC	0x474f4c45
+// Version of saved values (see env_migrate). Environment of old firmware is version 0.
+// Batches of version 1 are checked by CRC16 instead of CRC-32 unit (see env_batch_crc)
+#define ENV_VERSION	2
+
+// Environment of old firmware in the last page (only read and erased)
+#define ENV_ADDR	0x0801fc00
+#define ENV_MAGIC	0x564e45aa
+
+// Slot of variable in saved environment: saved values are found by it, so never renumber or
+// reuse slots of removed variables
+#define ENV_SLOT_ADC_OVEREMPTY	0
+#define ENV_SLOT_ADC_EMPTY	1
+#define ENV_SLOT_ADC_FULL	2
+#define ENV_SLOT_ADC_ALERT	3
+#define ENV_SLOT_STEPS_EMPTY	4
+#define ENV_SLOT_STEPS_FULL	5
+#define ENV_SLOT_STEPS_TOTAL	6
+#define ENV_SLOT_USE_EMA_FILTER	7
+#define ENV_SLOT_USE_STALLGUARD	8
+#define ENV_SLOT_HOME_PERIOD	9
+#define ENV_SLOT_BACKLASH	10
+#define ENV_SLOT_DIR_HYSTERESIS	11
+#define ENV_SLOT_TX_POLICY	12
+#define ENV_SLOT_BAUDRATE	13
+#define ENV_SLOT_LOG_PERIOD	14
+#define ENV_SLOTS		15  // up to 32
+#define ENV_SLOT_COMMIT		0x8000  // record closing batch of records
+
+struct env_page_header {
+	uint32_t magic;
+	uint32_t seq;  // pages are replayed in order of seq
+	uint32_t seq_check;  // ~seq, header is not valid if it was not completely programmed
+	uint32_t version;  // ENV_VERSION of firmware which wrote the page
+};
+
+// Every saved change of variable. Erased flash (all 0xff) is the end of log.
+// Batch of records is applied only if it is followed by commit record (ENV_SLOT_COMMIT) with
+// value = count of records | low half of CRC-32 of records << 16
+struct env_record {
+	uint16_t slot;
+	uint16_t check;
+	uint32_t value;
+};
+
+#define ENV_TYPE_UINT	0
+#define ENV_TYPE_BOOL	1
+
+struct env_var {
+	const char *name;
+	uint32_t *value;
+	const char *help;
+	const char *unit;  // NULL for counts without unit
+	uint32_t def;
+	uint32_t min;
+	uint32_t max;
+	uint8_t slot;
+	uint8_t type;  // ENV_TYPE_*
+};
+
+// Check of several variables which depend on each other. Returns NULL if values are correct,
+// otherwise error text
+struct env_check {
+	const char *name;
+	const char *(*func)(void);
+};
+
+#define ENV_DEFINE(_name, _slot, _type, _default, _min, _max, _unit, _help) \
+	uint32_t env_##_name = (_default); \
+	static const struct env_var __env_##_name \
+	__attribute__((used, section(".env." #_name), aligned(4))) = { \
+		.name = #_name, \
+		.value = &env_##_name, \
+		.help = _help, \
+		.unit = _unit, \
+		.def = _default, \
+		.min = _min, \
+		.max = _max, \
+		.slot = _slot, \
+		.type = _type, \
+	}
+
+// Defines variable env_<name> in RAM and its description in flash. Descriptions of all files are
+// collected by linker into one table sorted by name (see .env in linker script).
+// Values are checked when they are set or loaded, so code using them does not check them again
+#define ENV_VAR(_name, _slot, _default, _min, _max, _unit, _help) \
+	ENV_DEFINE(_name, _slot, ENV_TYPE_UINT, _default, _min, _max, _unit, _help)
+#define ENV_BOOL(_name, _slot, _default, _help) \
+	ENV_DEFINE(_name, _slot, ENV_TYPE_BOOL, _default, 0, 1, NULL, _help)
+
+#define ENV_CHECK(_name, _func) \
+	static const struct env_check __env_check_##_name \
+	__attribute__((used, section(".env_check." #_name), aligned(4))) = { \
+		.name = #_name, \
+		.func = _func, \
+	}
+
+// Variables are numbered in order of names
+unsigned int env_count(void);
+const struct env_var *env_get(unsigned int index);
+const struct env_var *env_find(const char *name);
+
+// Values out of range are replaced by defaults. If checks of variables fail, all defaults are
+// restored and -1 is returned. Fails while env_save or env_delete is running
+int env_load(void);
+// Appends changed values to log, compacts log when its free page is needed. Flash is erased and
+// programmed by jobs in background (see env_status). Returns -1 if previous save is not done yet
+int env_save(void);
+// Erases log and environment of old firmware in background as env_save
+int env_delete(void);
+// 1 while jobs of env_save or env_delete are running, then 0 or -1 if they failed
+int env_status(void);
+// Returns NULL if value is set, otherwise error text (value is not changed)
+const char *env_set(const struct env_var *e, uint32_t value);
+// Prints all variables or only one with this name
+void env_print(uint8_t num, const char *name);
+
+// Handlers of PROTO_MSG_ENV_GET, PROTO_MSG_ENV_SET and PROTO_MSG_ENV_SAVE (index is as in env_get)
+uint8_t env_proto_get(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+uint8_t env_proto_set(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+uint8_t env_proto_save(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+
+#endif  // _ENV_H
@@ -0,0 +1,23 @@
+#ifndef _EXTI_H
+#define _EXTI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "gpio.h"
+
+#define EXTI_TRIGGER_RISING BIT(0)
+#define EXTI_TRIGGER_FALLING BIT(1)
+
+#ifdef STM32F1
+#define EXTI_LINE_PVD 16
+#endif
+
+void exti_init(uint8_t line, uint32_t trigger);
+void exti_gpio_init(gpio_t gpio, uint32_t trigger);
+void exti_enable(uint8_t line, bool enable);
+bool exti_is_pending(uint8_t line);
+void exti_clear_pending(uint8_t line);
+
+#endif  // _EXTI_H
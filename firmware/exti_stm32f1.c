@@ -0,0 +1,63 @@
+#include "common.h"
+#include "exti.h"
+
+#define EXTI_BASE_ADDR 0x40010400
+#define AFIO_BASE_ADDR 0x40010000
+
+#define REG_IMR		(EXTI_BASE_ADDR + 0)
+#define REG_EMR		(EXTI_BASE_ADDR + 0x4)
+#define REG_RTSR	(EXTI_BASE_ADDR + 0x8)
+#define REG_FTSR	(EXTI_BASE_ADDR + 0xc)
+#define REG_SWIER	(EXTI_BASE_ADDR + 0x10)
+#define REG_PR		(EXTI_BASE_ADDR + 0x14)
+
+#define REG_AFIO_EXTICR(x)	(AFIO_BASE_ADDR + 0x8 + (x) * 4)
+
+static void exti_update_bit(uintptr_t addr, uint8_t line, bool set)
+{
+	uint32_t val = readl(addr);
+
+	if (set)
+		val |= BIT(line);
+	else
+		val &= ~BIT(line);
+
+	writel(val, addr);
+}
+
+void exti_init(uint8_t line, uint32_t trigger)
+{
+	exti_update_bit(REG_IMR, line, false);
+	exti_update_bit(REG_RTSR, line, !!(trigger & EXTI_TRIGGER_RISING));
+	exti_update_bit(REG_FTSR, line, !!(trigger & EXTI_TRIGGER_FALLING));
+	writel(BIT(line), REG_PR);
+}
+
+// AFIO clock must be enabled before
+void exti_gpio_init(gpio_t gpio, uint32_t trigger)
+{
+	uint8_t pin = GPIO_TO_PIN(gpio);
+	uint32_t shift = (pin & 0x3) * 4;
+	uint32_t val;
+
+	val = readl(REG_AFIO_EXTICR(pin >> 2));
+	val = (val & ~(0xf << shift)) | (GPIO_TO_BANK(gpio) << shift);
+	writel(val, REG_AFIO_EXTICR(pin >> 2));
+
+	exti_init(pin, trigger);
+}
+
+void exti_enable(uint8_t line, bool enable)
+{
+	exti_update_bit(REG_IMR, line, enable);
+}
+
+RAMFUNC bool exti_is_pending(uint8_t line)
+{
+	return !!(readl(REG_PR) & BIT(line));
+}
+
+RAMFUNC void exti_clear_pending(uint8_t line)
+{
+	writel(BIT(line), REG_PR);
+}
@@ -1,10 +1,47 @@
 #ifndef _FLASH_H
 #define _FLASH_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// Type of flash job
+#define FLASH_JOB_ERASE		0  // erase page at addr
+#define FLASH_JOB_PROGRAM	1  // program and verify len bytes of data at addr
+
+// Status of flash job
+#define FLASH_JOB_QUEUED	0
+#define FLASH_JOB_RUNNING	1
+#define FLASH_JOB_DONE		2
+#define FLASH_JOB_FAILED	3
+
+// Job and its data must stay valid until it is completed
+struct flash_job {
+	uint8_t type;
+	uintptr_t addr;
+	const void *data;
+	unsigned int len;
+	// Called from flash interrupt, res is 0 or -1. Can submit new jobs
+	void (*done)(struct flash_job *job, int res);
+	void *arg;
+	// Private
+	struct flash_job *next;
+	unsigned int pos;
+	volatile uint8_t status;
+};
+
+// Synchronous functions wait until all queued jobs are completed. They run from RAM, so their
+// busy-wait loops don't stall on fetch from flash being erased or programmed
 int flash_erase_page(uintptr_t addr);
 int flash_program(uintptr_t addr, void *ptr, unsigned int len);
 int flash_verify(uintptr_t addr, void *ptr, unsigned int len);
 
+// Jobs are done one halfword or page erase per flash interrupt, so CPU runs main loop meanwhile.
+// Note that CPU still waits while it fetches code or data from flash during erase or program:
+// only RAMFUNC interrupt handlers (motor timer, USART receive, tick) run then
+void flash_irq_enable(void);
+int flash_job_submit(struct flash_job *job);
+// True while queue has not completed jobs or synchronous function is running (it may be
+// interrupted, so interrupts must check this before any flash operation)
+bool flash_is_busy(void);
+
 #endif  // _FLASH_H
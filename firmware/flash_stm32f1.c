@@ -2,6 +2,7 @@
 
 #include <common.h>
 #include <flash.h>
+#include <nvic.h>
 #include <usart.h>
 
 #define FLASH_REGS_BASE_ADDR 0x40022000
@@ -39,24 +40,24 @@
 #define KEY2	0xcdef89ab
 #define RDPRT	0xa5
 
-static void flash_unlock(void)
+static RAMFUNC void flash_unlock(void)
 {
 	writel(KEY1, REG_KEYR);
 	writel(KEY2, REG_KEYR);
 }
 
-static void flash_check_and_unlock(void)
+static RAMFUNC void flash_check_and_unlock(void)
 {
 	if (readl(REG_CR) & CR_LOCK)
 		flash_unlock();
 }
 
-static void flash_lock(void)
+static RAMFUNC void flash_lock(void)
 {
 	writel(CR_LOCK, REG_CR);
 }
 
-static uint32_t flash_wait_for_busy(void)
+static RAMFUNC uint32_t flash_wait_for_busy(void)
 {
 	uint32_t sr;
 	uint32_t count = 10;
@@ -66,17 +67,137 @@ static uint32_t flash_wait_for_busy(void)
 	} while (sr & SR_BSY);
 
 	// Sometimes EOP bit is not set with BSY clear
-	while (!(sr & SR_EOP) && count) {
+	while (!(sr & SR_EOP) && count--) {
 		sr = readl(REG_SR);
 	}
 
 	return sr;
 }
 
-int flash_erase_page(uintptr_t addr)
+static struct flash_job *volatile queue_head;
+static struct flash_job *queue_tail;
+static bool is_irq_enabled;
+// Synchronous erase or program is running (maybe interrupted)
+static volatile bool is_sync_busy;
+
+static RAMFUNC void flash_wait_for_queue(void)
+{
+	while (queue_head) {
+	}
+}
+
+// Starts the first queued job or locks flash when queue is empty
+static RAMFUNC void flash_job_start(void)
+{
+	struct flash_job *job = queue_head;
+
+	if (!job) {
+		flash_lock();
+		return;
+	}
+
+	job->status = FLASH_JOB_RUNNING;
+	job->pos = 0;
+	flash_check_and_unlock();
+	writel(SR_EOP | SR_WRPRTERR | SR_PGERR, REG_SR);
+	if (job->type == FLASH_JOB_ERASE) {
+		writel(CR_PER | CR_EOPIE | CR_ERRIE, REG_CR);
+		writel(job->addr, REG_AR);
+		writel(CR_PER | CR_STRT | CR_EOPIE | CR_ERRIE, REG_CR);
+	} else {
+		writel(CR_PG | CR_EOPIE | CR_ERRIE, REG_CR);
+		write16(((const uint16_t *)job->data)[0], job->addr);
+	}
+}
+
+static RAMFUNC void flash_job_finish(struct flash_job *job, int res)
+{
+	writel(0, REG_CR);
+	queue_head = job->next;
+	if (!queue_head)
+		queue_tail = NULL;
+
+	job->status = res ? FLASH_JOB_FAILED : FLASH_JOB_DONE;
+	if (job->done)
+		job->done(job, res);
+
+	// Job submitted by done callback into empty queue is already started
+	if (!queue_head || queue_head->status != FLASH_JOB_RUNNING)
+		flash_job_start();
+}
+
+RAMFUNC void FLASH_IRQHandler(void)
+{
+	struct flash_job *job = queue_head;
+	uint32_t sr = readl(REG_SR);
+
+	writel(SR_EOP | SR_WRPRTERR | SR_PGERR, REG_SR);
+	if (!job)
+		return;
+
+	if (sr & (SR_WRPRTERR | SR_PGERR)) {
+		flash_job_finish(job, -1);
+		return;
+	}
+
+	if (job->type == FLASH_JOB_ERASE) {
+		flash_job_finish(job, 0);
+		return;
+	}
+
+	if (read16(job->addr + job->pos) != ((const uint16_t *)job->data)[job->pos >> 1]) {
+		flash_job_finish(job, -1);
+		return;
+	}
+
+	job->pos += 2;
+	if (job->pos >= job->len) {
+		flash_job_finish(job, 0);
+		return;
+	}
+
+	write16(((const uint16_t *)job->data)[job->pos >> 1], job->addr + job->pos);
+}
+
+void flash_irq_enable(void)
+{
+	is_irq_enabled = true;
+	nvic_enable_irq(IRQ_FLASH);
+}
+
+int flash_job_submit(struct flash_job *job)
+{
+	if (!is_irq_enabled || (job->type == FLASH_JOB_PROGRAM && (!job->len || (job->len & 1))))
+		return -1;
+
+	job->next = NULL;
+	job->status = FLASH_JOB_QUEUED;
+	// Queue is changed by interrupt too
+	nvic_disable_irq(IRQ_FLASH);
+	if (queue_tail) {
+		queue_tail->next = job;
+		queue_tail = job;
+	} else {
+		queue_head = job;
+		queue_tail = job;
+		flash_job_start();
+	}
+	nvic_enable_irq(IRQ_FLASH);
+
+	return 0;
+}
+
+bool flash_is_busy(void)
+{
+	return queue_head != NULL || is_sync_busy;
+}
+
+RAMFUNC int flash_erase_page(uintptr_t addr)
 {
 	uint32_t sr;
 
+	flash_wait_for_queue();
+	is_sync_busy = true;
 	flash_check_and_unlock();
 	writel(SR_EOP | SR_WRPRTERR | SR_PGERR, REG_SR);
 	writel(CR_PER, REG_CR);
@@ -84,6 +205,7 @@ int flash_erase_page(uintptr_t addr)
 	writel(CR_PER | CR_STRT, REG_CR);
 	sr = flash_wait_for_busy();
 	flash_lock();
+	is_sync_busy = false;
 
 	return (sr & SR_EOP) ? 0 : -1;
 }
@@ -101,7 +223,7 @@ int flash_verify(uintptr_t addr, void *ptr, unsigned int len)
 	return 0;
 }
 
-int flash_program(uintptr_t addr, void *ptr, unsigned int len)
+RAMFUNC int flash_program(uintptr_t addr, void *ptr, unsigned int len)
 {
 	uint16_t *data = (uint16_t *)ptr;
 	unsigned int pos = 0;
@@ -110,6 +232,8 @@ int flash_program(uintptr_t addr, void *ptr, unsigned int len)
 	if (!len)
 		return 0;
 
+	flash_wait_for_queue();
+	is_sync_busy = true;
 	flash_check_and_unlock();
 	writel(CR_PG, REG_CR);
 	for (pos = 0; pos < len; pos += 2) {
@@ -121,6 +245,7 @@ int flash_program(uintptr_t addr, void *ptr, unsigned int len)
 	}
 
 	flash_lock();
+	is_sync_busy = false;
 
 	return (sr & SR_EOP) ? 0 : -1;
 }
@@ -0,0 +1,329 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "format.h"
+
+#define FLAG_LEFT	BIT(0)
+#define FLAG_ZERO	BIT(1)
+#define FLAG_SPACE	BIT(2)
+#define FLAG_PLUS	BIT(3)
+#define FLAG_ALT	BIT(4)
+
+// Enough for 32-bit value in any supported base with fixed point
+#define NUM_BUF_SIZE	24
+
+struct format_out {
+	format_sink_t sink;
+	void *ctx;
+	int count;
+};
+
+struct format_spec {
+	uint32_t flags;
+	int width;
+	int precision;  // -1 if not set
+};
+
+struct format_buf {
+	char *buf;
+	unsigned int size;
+	unsigned int pos;
+};
+
+static const char digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint32_t pow10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+// Writes decimal digits before end, returns pointer to the first digit.
+// Two digits per division: division by constant 100 is compiled to multiplication by reciprocal.
+static char *format_utoa(uint32_t value, char *end)
+{
+	char *p = end;
+
+	while (value >= 100) {
+		uint32_t q = value / 100;
+		uint32_t r = value - q * 100;
+
+		p -= 2;
+		memcpy(p, &digit_pairs[r * 2], 2);
+		value = q;
+	}
+
+	if (value >= 10) {
+		p -= 2;
+		memcpy(p, &digit_pairs[value * 2], 2);
+	} else {
+		*--p = '0' + value;
+	}
+
+	return p;
+}
+
+static char *format_xtoa(uint32_t value, char *end, bool is_upper)
+{
+	const char *digits = is_upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char *p = end;
+
+	do {
+		*--p = digits[value & 0xf];
+		value >>= 4;
+	} while (value);
+
+	return p;
+}
+
+// Fixed-point: value is divided by 10^precision
+static char *format_fixed(uint32_t value, int precision, char *end)
+{
+	uint32_t div = pow10[precision];
+	char *p;
+
+	p = format_utoa(value % div, end);
+	while (end - p < precision)
+		*--p = '0';
+
+	*--p = '.';
+
+	return format_utoa(value / div, p);
+}
+
+static void format_put(struct format_out *out, const char *s, unsigned int len)
+{
+	if (!len)
+		return;
+
+	out->sink(out->ctx, s, len);
+	out->count += len;
+}
+
+static void format_pad(struct format_out *out, char c, int count)
+{
+	char buf[8];
+
+	if (count <= 0)
+		return;
+
+	memset(buf, c, sizeof(buf));
+	while (count > 0) {
+		int chunk = count > sizeof(buf) ? sizeof(buf) : count;
+
+		format_put(out, buf, chunk);
+		count -= chunk;
+	}
+}
+
+static void format_field(struct format_out *out, struct format_spec *spec,
+			 const char *prefix, const char *body, int len)
+{
+	int prefix_len = strlen(prefix);
+	int pad = spec->width - prefix_len - len;
+
+	if (!(spec->flags & (FLAG_LEFT | FLAG_ZERO)))
+		format_pad(out, ' ', pad);
+
+	format_put(out, prefix, prefix_len);
+	if ((spec->flags & (FLAG_LEFT | FLAG_ZERO)) == FLAG_ZERO)
+		format_pad(out, '0', pad);
+
+	format_put(out, body, len);
+	if (spec->flags & FLAG_LEFT)
+		format_pad(out, ' ', pad);
+}
+
+static void format_int(struct format_out *out, struct format_spec *spec, uint32_t value, bool is_signed)
+{
+	char buf[NUM_BUF_SIZE];
+	char *end = buf + sizeof(buf);
+	char *p;
+	char *prefix = "";
+
+	if (is_signed && (int32_t)value < 0) {
+		prefix = "-";
+		value = -(int32_t)value;
+	} else if (is_signed && (spec->flags & FLAG_PLUS)) {
+		prefix = "+";
+	} else if (is_signed && (spec->flags & FLAG_SPACE)) {
+		prefix = " ";
+	}
+
+	if (spec->precision > 0)
+		p = format_fixed(value, spec->precision, end);
+	else
+		p = format_utoa(value, end);
+
+	format_field(out, spec, prefix, p, end - p);
+}
+
+int format_vprintf(format_sink_t sink, void *ctx, const char *fmt, va_list args)
+{
+	struct format_out out = { sink, ctx, 0 };
+
+	while (*fmt) {
+		struct format_spec spec = { 0, 0, -1 };
+		const char *start = fmt;
+		char buf[NUM_BUF_SIZE];
+		char *end = buf + sizeof(buf);
+		char *p;
+
+		// Plain text goes to sink by one piece
+		while (*fmt && *fmt != '%')
+			fmt++;
+
+		format_put(&out, start, fmt - start);
+		if (!*fmt)
+			break;
+
+		fmt++;
+		for (;; fmt++) {
+			if (*fmt == '-')
+				spec.flags |= FLAG_LEFT;
+			else if (*fmt == '0')
+				spec.flags |= FLAG_ZERO;
+			else if (*fmt == ' ')
+				spec.flags |= FLAG_SPACE;
+			else if (*fmt == '+')
+				spec.flags |= FLAG_PLUS;
+			else if (*fmt == '#')
+				spec.flags |= FLAG_ALT;
+			else
+				break;
+		}
+
+		if (*fmt == '*') {
+			spec.width = va_arg(args, int);
+			if (spec.width < 0) {
+				spec.flags |= FLAG_LEFT;
+				spec.width = -spec.width;
+			}
+			fmt++;
+		} else {
+			while (*fmt >= '0' && *fmt <= '9')
+				spec.width = spec.width * 10 + (*fmt++ - '0');
+		}
+
+		if (*fmt == '.') {
+			fmt++;
+			spec.precision = 0;
+			while (*fmt >= '0' && *fmt <= '9')
+				spec.precision = spec.precision * 10 + (*fmt++ - '0');
+
+			if (spec.precision >= ARRAY_SIZE(pow10))
+				spec.precision = ARRAY_SIZE(pow10) - 1;
+		}
+
+		while (*fmt == 'l' || *fmt == 'h')
+			fmt++;
+
+		switch (*fmt) {
+		case 'd':
+		case 'i':
+			format_int(&out, &spec, va_arg(args, uint32_t), true);
+			break;
+		case 'u':
+			format_int(&out, &spec, va_arg(args, uint32_t), false);
+			break;
+		case 'x':
+		case 'X':
+			p = format_xtoa(va_arg(args, uint32_t), end, *fmt == 'X');
+			format_field(&out, &spec, (spec.flags & FLAG_ALT) ? "0x" : "", p, end - p);
+			break;
+		case 'c':
+			buf[0] = (char)va_arg(args, int);
+			spec.flags &= ~FLAG_ZERO;
+			format_field(&out, &spec, "", buf, 1);
+			break;
+		case 's':
+			p = va_arg(args, char *);
+			if (!p)
+				p = "(null)";
+
+			spec.flags &= ~FLAG_ZERO;
+			if (spec.precision >= 0)
+				format_field(&out, &spec, "", p, strnlen(p, spec.precision));
+			else
+				format_field(&out, &spec, "", p, strlen(p));
+			break;
+		case '%':
+			format_put(&out, "%", 1);
+			break;
+		case '\0':
+			return out.count;
+		default:
+			// Unknown specifier is printed as is
+			format_put(&out, "%", 1);
+			format_put(&out, fmt, 1);
+			break;
+		}
+
+		fmt++;
+	}
+
+	return out.count;
+}
+
+int format_printf(format_sink_t sink, void *ctx, const char *fmt, ...)
+{
+	va_list args;
+	int res;
+
+	va_start(args, fmt);
+	res = format_vprintf(sink, ctx, fmt, args);
+	va_end(args);
+
+	return res;
+}
+
+static void format_buf_sink(void *ctx, const char *s, unsigned int len)
+{
+	struct format_buf *b = ctx;
+
+	if (b->pos + 1 < b->size) {
+		unsigned int chunk = b->size - 1 - b->pos;
+
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(b->buf + b->pos, s, chunk);
+	}
+
+	b->pos += len;
+}
+
+int format_vsnprintf(char *buf, unsigned int size, const char *fmt, va_list args)
+{
+	struct format_buf b = { buf, size, 0 };
+	int res;
+
+	res = format_vprintf(format_buf_sink, &b, fmt, args);
+	if (size)
+		buf[b.pos < size ? b.pos : size - 1] = '\0';
+
+	return res;
+}
+
+int format_snprintf(char *buf, unsigned int size, const char *fmt, ...)
+{
+	va_list args;
+	int res;
+
+	va_start(args, fmt);
+	res = format_vsnprintf(buf, size, fmt, args);
+	va_end(args);
+
+	return res;
+}
@@ -0,0 +1,21 @@
+#ifndef _FORMAT_H
+#define _FORMAT_H
+
+#include <stdarg.h>
+#include <stdint.h>
+
+// Receives formatted output by pieces (not null-terminated)
+typedef void (*format_sink_t)(void *ctx, const char *s, unsigned int len);
+
+// Supported: %d %i %u %x %X %c %s %% with flags '-', '0', ' ', '+', '#', width and precision.
+// Precision for %d/%i/%u prints fixed-point number: ("%.2d", -1234) gives "-12.34".
+// Precision for %s limits length of string. Length modifiers (l, h) are accepted and ignored.
+// Returns count of characters written to sink.
+int format_vprintf(format_sink_t sink, void *ctx, const char *fmt, va_list args);
+int format_printf(format_sink_t sink, void *ctx, const char *fmt, ...);
+
+// Output is always null-terminated (if size > 0). Returns length of full output as snprintf does.
+int format_vsnprintf(char *buf, unsigned int size, const char *fmt, va_list args);
+int format_snprintf(char *buf, unsigned int size, const char *fmt, ...);
+
+#endif  // _FORMAT_H
@@ -0,0 +1,162 @@
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "console.h"
+#include "delay.h"
+#include "format.h"
+#include "usart.h"
+
+#define BENCH_DEFAULT_COUNT	100
+
+struct legacy_buf {
+	char buf[128];
+	unsigned int pos;
+};
+
+// Previous implementation of usart_printf: output char by char and two divisions per digit
+static void legacy_putc(struct legacy_buf *b, char c)
+{
+	if (b->pos < sizeof(b->buf))
+		b->buf[b->pos++] = c;
+}
+
+static void legacy_puts(struct legacy_buf *b, char *s)
+{
+	while (*s)
+		legacy_putc(b, *s++);
+}
+
+static void legacy_puthex(struct legacy_buf *b, uint32_t hex, uint32_t digits)
+{
+	static const char tohex[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
+					'8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+	int start = 0;
+
+	for (int i = 0; i < 8; i++) {
+		if ((hex >> (4 * (7 - i))) & 0xF)
+			break;
+		start++;
+	}
+	if (digits < (8 - start))
+		digits = 8 - start;
+
+	start = 8 - digits;
+	if (start > 7)
+		start = 7;
+
+	for (int i = start; i < 8; i++)
+		legacy_putc(b, tohex[(hex >> (4 * (7 - i))) & 0xF]);
+}
+
+static void legacy_putint(struct legacy_buf *b, uint32_t data, int is_signed)
+{
+	char buf[12];
+	int pos = sizeof(buf);
+	int is_neg = is_signed && (((int32_t)data) < 0);
+
+	buf[--pos] = '\0';
+	if (data == 0)
+		buf[--pos] = '0';
+	else if (is_neg)
+		data = -((int32_t)data);
+
+	while (data) {
+		buf[--pos] = '0' + (data % 10);
+		data /= 10;
+	}
+	if (is_neg)
+		buf[--pos] = '-';
+
+	legacy_puts(b, buf + pos);
+}
+
+static void legacy_printf(struct legacy_buf *b, char *s, ...)
+{
+	uint32_t digits = 0;
+	int is_percent_handler = 0;
+	va_list args;
+
+	b->pos = 0;
+	va_start(args, s);
+	while (*s) {
+		if (*s == '%') {
+			digits = 0;
+			is_percent_handler = 1;
+			s++;
+			continue;
+		}
+		if (is_percent_handler) {
+			switch (*s) {
+			case 'x':
+				legacy_puthex(b, va_arg(args, uint32_t), digits);
+				break;
+			case 'd':
+			case 'u':
+				legacy_putint(b, va_arg(args, uint32_t), *s != 'u');
+				break;
+			case 's':
+				legacy_puts(b, va_arg(args, char *));
+				break;
+			default:
+				if (*s >= '0' && *s <= '9') {
+					digits = digits * 10 + (*s - '0');
+					s++;
+					continue;
+				}
+				break;
+			}
+			is_percent_handler = 0;
+			s++;
+		} else
+			legacy_putc(b, *s++);
+	}
+	va_end(args);
+}
+
+// Compare CPU cycles per formatted line of previous and current formatter (both to memory)
+static int cmd_bench_format(uint8_t num, int argc, char *argv[])
+{
+	struct legacy_buf legacy;
+	char buf[128];
+	uint32_t count = BENCH_DEFAULT_COUNT;
+	uint32_t start;
+	uint32_t legacy_cycles;
+	uint32_t cycles;
+
+	if (argc) {
+		char *s = argv[0];
+
+		count = 0;
+		while (*s >= '0' && *s <= '9')
+			count = count * 10 + (*s++ - '0');
+
+		if (!count || *s) {
+			usart_printf(num, "Error: Argument '%s' is not a positive integer\n", argv[0]);
+			return -1;
+		}
+	}
+
+	start = get_tick();
+	for (uint32_t i = 0; i < count; i++) {
+		legacy_printf(&legacy, "%s : %d  (%s)\n", "adc_empty", 800 + i, "значение АЦП");
+		legacy_printf(&legacy, "step_tick:      %u (%u ms ago)\n", 123456789 + i, 4000000000u);
+		legacy_printf(&legacy, "addr: %8x value: %d\n", 0x0801fc00 + i, -1234567);
+	}
+	legacy_cycles = get_tick() - start;
+
+	start = get_tick();
+	for (uint32_t i = 0; i < count; i++) {
+		format_snprintf(buf, sizeof(buf), "%s : %d  (%s)\n", "adc_empty", 800 + i, "значение АЦП");
+		format_snprintf(buf, sizeof(buf), "step_tick:      %u (%u ms ago)\n", 123456789 + i, 4000000000u);
+		format_snprintf(buf, sizeof(buf), "addr: %08x value: %d\n", 0x0801fc00 + i, -1234567);
+	}
+	cycles = get_tick() - start;
+
+	usart_printf(num, "lines:   %u\n", count * 3);
+	usart_printf(num, "legacy:  %u cycles/line\n", legacy_cycles / (count * 3));
+	usart_printf(num, "current: %u cycles/line\n", cycles / (count * 3));
+
+	return 0;
+}
+CONSOLE_CMD(bench_format, cmd_bench_format, 0, 1, "сравнить время форматирования строк (в тактах процессора) прежней и текущей реализацией printf... arg1 - количество повторов");
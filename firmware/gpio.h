@@ -21,6 +21,7 @@
 #define GEN_GPIO(bank, pin) (((bank) << 4) | (pin))
 #define GPIO_TO_BANK(gpio) ((gpio) >> 4)
 #define GPIO_TO_PIN(gpio) ((gpio) & 0xf)
+#define GPIO_NONE 0xff
 
 #define BANK_GPIOA 0
 #define BANK_GPIOB 1
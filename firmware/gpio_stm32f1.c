@@ -42,7 +42,7 @@ void gpio_init(gpio_t gpio, uint8_t dir, uint8_t drv, uint8_t speed, uint32_t fl
 	writel(reg_val, addr);
 }
 
-void gpio_pin_set(gpio_t gpio, uint32_t val)
+RAMFUNC void gpio_pin_set(gpio_t gpio, uint32_t val)
 {
 	uintptr_t addr = GPIO_BANK_TO_ADDR(GPIO_TO_BANK(gpio));
 	uint8_t pin = GPIO_TO_PIN(gpio);
@@ -53,7 +53,7 @@ void gpio_pin_set(gpio_t gpio, uint32_t val)
 		writel(BIT(pin), addr + GPIO_REG_BRR);
 }
 
-uint32_t gpio_pin_get(gpio_t gpio)
+RAMFUNC uint32_t gpio_pin_get(gpio_t gpio)
 {
 	uintptr_t addr = GPIO_BANK_TO_ADDR(GPIO_TO_BANK(gpio));
 	uint8_t pin = GPIO_TO_PIN(gpio);
@@ -0,0 +1,38 @@
+#!/usr/bin/env python
+
+import argparse
+
+
+def crc32_stm32(data):
+    """CRC-32 of STM32 unit: 32-bit little-endian words, no reflection and final xor"""
+    crc = 0xffffffff
+    for pos in range(0, len(data), 4):
+        crc ^= int.from_bytes(data[pos:pos + 4], "little")
+        for _ in range(32):
+            crc = ((crc << 1) ^ 0x04c11db7 if crc & 0x80000000 else crc << 1) & 0xffffffff
+
+    return crc
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Calculate CRC-32 of application image for .image_crc section (see integrity.h)")
+    parser.add_argument("image", help="binary image without .image_crc section")
+    parser.add_argument("output", help="4-byte content of .image_crc section")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        data = f.read()
+
+    if len(data) % 4:
+        raise Exception(f"Image size {len(data)} is not multiple of 4")
+
+    crc = crc32_stm32(data)
+    with open(args.output, "wb") as f:
+        f.write(crc.to_bytes(4, "little"))
+
+    print(f"Image CRC-32: {crc:#010x} ({len(data)} bytes)")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,128 @@
+#include <stdint.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "common.h"
+#include "console.h"
+#include "crc.h"
+#include "delay.h"
+#include "integrity.h"
+#include "usart.h"
+
+struct integrity {
+	const uint32_t *image;
+	unsigned int words;
+	unsigned int pos;  // words already in crc
+	uint32_t crc;
+	uint32_t slice_tick;
+	uint32_t pass_tick;  // start of current pass
+	uint32_t pass_time;  // ms of last pass
+	uint32_t slice_max;  // CPU ticks of the longest slice
+	uint32_t passes;
+	uint32_t mismatches;
+	uint32_t last_crc;
+	bool is_failed;
+};
+
+extern uint32_t _vtor[];
+
+const uint32_t image_crc __attribute__((section(".image_crc"), used)) = INTEGRITY_NOT_SET;
+
+static struct integrity integrity;
+
+void integrity_init(void)
+{
+	integrity.image = _vtor;
+	integrity.words = &image_crc - _vtor;
+	integrity.pos = 0;
+	integrity.crc = CRC_INIT;
+	integrity.slice_tick = HAL_GetTick();
+	integrity.pass_tick = integrity.slice_tick;
+}
+
+static bool integrity_pass_done(uint32_t tick)
+{
+	integrity.last_crc = integrity.crc;
+	integrity.pass_time = tick - integrity.pass_tick;
+	integrity.pass_tick = tick;
+	integrity.passes++;
+	integrity.pos = 0;
+	integrity.crc = CRC_INIT;
+
+	if (image_crc == INTEGRITY_NOT_SET || integrity.last_crc == image_crc)
+		return false;
+
+	integrity.mismatches++;
+	if (integrity.is_failed)
+		return false;
+
+	integrity.is_failed = true;
+
+	return true;
+}
+
+bool integrity_process(void)
+{
+	uint32_t tick = HAL_GetTick();
+	uint32_t start;
+	uint32_t spent;
+
+	// Asynchronous calculation owns CRC unit until its end
+	if (tick - integrity.slice_tick < INTEGRITY_PERIOD || crc_is_busy())
+		return false;
+
+	integrity.slice_tick = tick;
+	start = get_tick();
+	do {
+		unsigned int len = integrity.words - integrity.pos;
+
+		if (len > INTEGRITY_CHUNK)
+			len = INTEGRITY_CHUNK;
+
+		integrity.crc = crc_update(integrity.crc, &integrity.image[integrity.pos], len);
+		integrity.pos += len;
+		spent = get_tick() - start;
+	} while (integrity.pos < integrity.words && tick2us(spent) < INTEGRITY_BUDGET);
+
+	if (spent > integrity.slice_max)
+		integrity.slice_max = spent;
+
+	if (integrity.pos < integrity.words)
+		return false;
+
+	return integrity_pass_done(tick);
+}
+
+bool integrity_is_failed(void)
+{
+	return integrity.is_failed;
+}
+
+static int cmd_integrity_info(uint8_t num, int argc, char *argv[])
+{
+	usart_printf(num, "image:    %#010x, %u bytes\n", (uintptr_t)integrity.image, integrity.words * 4);
+	usart_printf(num, "progress: %u%%\n", integrity.pos * 100 / integrity.words);
+	usart_printf(num, "passes:   %u, last %u ms\n", integrity.passes, integrity.pass_time);
+	usart_printf(num, "slice:    %u us max, budget %u us every %u ms\n", tick2us(integrity.slice_max),
+		     INTEGRITY_BUDGET, INTEGRITY_PERIOD);
+	if (image_crc == INTEGRITY_NOT_SET)
+		usart_puts(num, "expected: not embedded\n");
+	else
+		usart_printf(num, "expected: %#010x\n", image_crc);
+
+	if (!integrity.passes) {
+		usart_puts(num, "last:     none\n");
+		return 0;
+	}
+
+	usart_printf(num, "last:     %#010x\n", integrity.last_crc);
+	if (image_crc == INTEGRITY_NOT_SET)
+		usart_puts(num, "status:   unknown\n");
+	else if (integrity.is_failed)
+		usart_printf(num, "status:   FAIL (%u of %u passes)\n", integrity.mismatches, integrity.passes);
+	else
+		usart_puts(num, "status:   ok\n");
+
+	return 0;
+}
+CONSOLE_CMD(integrity_info, cmd_integrity_info, 0, 0, "вывести состояние фоновой проверки CRC образа программы во Flash-памяти");
@@ -0,0 +1,24 @@
+#ifndef _INTEGRITY_H
+#define _INTEGRITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Background check of application image in flash. Main loop feeds CRC unit (crc_update) with a
+// slice of image every INTEGRITY_PERIOD for no longer than INTEGRITY_BUDGET, after the last slice
+// CRC-32 of image is compared with image_crc which is embedded by image_crc.py after link.
+// Image is from the vector table up to image_crc (the last word of application in flash)
+#define INTEGRITY_PERIOD	10  // ms between slices
+#define INTEGRITY_BUDGET	20  // us of one slice, exceeded by no more than one chunk
+#define INTEGRITY_CHUNK		32  // words fed to CRC unit at once
+#define INTEGRITY_NOT_SET	0xffffffff  // image_crc of build without image_crc.py
+
+extern const uint32_t image_crc;
+
+void integrity_init(void);
+// Called from main loop: returns true once, when CRC of image is wrong first time
+bool integrity_process(void);
+// Mismatch stays until reset: damaged flash doesn't repair itself
+bool integrity_is_failed(void);
+
+#endif  // _INTEGRITY_H
@@ -0,0 +1,730 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "common.h"
+#include "console.h"
+#include "crc.h"
+#include "env.h"
+#include "flash.h"
+#include "logger.h"
+#include "usart.h"
+
+#define LOGGER_READ_LINES	4  // records printed by log_read per step
+#define LOGGER_READ_SCAN	64  // records decoded by log_read and log_info per step
+#define LOGGER_INFO_PAGES	4  // pages checked by log_info per step, CRC of every one is calculated
+
+struct logger {
+	uint8_t buf[LOGGER_PAGE_SIZE] __attribute__((aligned(4)));  // block of current page
+	struct flash_job erase_job;
+	struct flash_job program_job;
+	unsigned int page;
+	unsigned int len;  // encoded bytes of current block, 0 if block is not started
+	unsigned int flashed;  // bytes of current block which are already in flash
+	unsigned int write_end;
+	unsigned int run;  // records equal to the previous one which are not encoded yet
+	volatile bool is_writing;
+	volatile bool is_write_failed;
+	bool is_erased;
+	bool is_full;  // record didn't fit into block, it waits in next for the next page
+	bool was_ignition_off;
+	uint16_t period;  // of current block
+	struct logger_record prev;  // the last encoded record
+	struct logger_record next;
+	uint32_t seq;  // of the next record
+	uint32_t time_base;
+	uint32_t tick;
+	uint32_t dropped;  // records lost because page was still being written
+	// Interval of the next record
+	uint16_t level;
+	uint16_t raw_min;
+	uint16_t raw_max;
+	uint8_t flags;
+};
+
+static struct logger logger;
+
+ENV_VAR(log_period, ENV_SLOT_LOG_PERIOD, 10, 0, 3600, "с", "период записи уровня топлива в журнал во Flash-памяти (0 - не записывать)");
+
+static uint8_t logger_check(const struct logger_block *b)
+{
+	const uint8_t *data = (const uint8_t *)b;
+	uint8_t sum = 0;
+
+	for (int i = 0; i < sizeof(*b) - 1; i++)
+		sum += data[i];
+
+	return ~sum;
+}
+
+static uintptr_t logger_addr(unsigned int page)
+{
+	return LOGGER_ADDR + page * LOGGER_PAGE_SIZE;
+}
+
+static bool logger_header_is_valid(unsigned int page)
+{
+	const struct logger_block *b = (const struct logger_block *)logger_addr(page);
+
+	return b->magic == LOGGER_BLOCK_MAGIC && b->check == logger_check(b);
+}
+
+// Block which is not full has no CRC yet
+static bool logger_crc_is_valid(unsigned int page)
+{
+	uint32_t crc = readl(logger_addr(page) + LOGGER_BLOCK_SIZE);
+
+	return crc == 0xffffffff || crc == crc_calc((const void *)logger_addr(page), LOGGER_BLOCK_SIZE / 4);
+}
+
+static uint32_t zigzag_encode(int32_t value)
+{
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t zigzag_decode(uint32_t value)
+{
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static void logger_reset_interval(void)
+{
+	logger.raw_min = 0xffff;
+	logger.raw_max = 0;
+	logger.flags = 0;
+}
+
+static void logger_put_varint(uint32_t value)
+{
+	while (value >= 0x80) {
+		logger.buf[logger.len++] = value | 0x80;
+		value >>= 7;
+	}
+
+	logger.buf[logger.len++] = value;
+}
+
+static void logger_put_run(void)
+{
+	if (!logger.run)
+		return;
+
+	logger.buf[logger.len++] = logger.run - 1;
+	logger.run = 0;
+}
+
+static void logger_start_block(const struct logger_record *rec)
+{
+	struct logger_block *b = (struct logger_block *)logger.buf;
+
+	// Unused part of block is the same as erased flash for CRC
+	memset(logger.buf, 0xff, sizeof(logger.buf));
+	logger.period = env_log_period;
+	b->magic = LOGGER_BLOCK_MAGIC;
+	b->period = logger.period;
+	b->seq = rec->seq;
+	b->time = rec->time;
+	b->level = rec->level;
+	b->raw_min = rec->raw_min;
+	b->raw_max = rec->raw_max;
+	b->flags = rec->flags;
+	b->check = logger_check(b);
+	logger.len = sizeof(*b);
+	logger.run = 0;
+	logger.prev = *rec;
+}
+
+// Returns false if record doesn't fit into current block
+static bool logger_encode(const struct logger_record *rec)
+{
+	const struct logger_record *prev = &logger.prev;
+	int32_t dt = rec->time - prev->time - logger.period;
+	unsigned int need;
+	uint8_t fields = 0;
+
+	if (!logger.len) {
+		logger_start_block(rec);
+		return true;
+	}
+
+	if (dt)
+		fields |= LOGGER_DELTA_TIME;
+	if (rec->level != prev->level)
+		fields |= LOGGER_DELTA_LEVEL;
+	if (rec->raw_min != prev->raw_min)
+		fields |= LOGGER_DELTA_RAW_MIN;
+	if (rec->raw_max != prev->raw_max)
+		fields |= LOGGER_DELTA_RAW_MAX;
+	if (rec->flags != prev->flags)
+		fields |= LOGGER_DELTA_FLAGS;
+
+	// Tag of pending run and padding byte of flush always have to fit
+	need = !!logger.run;
+	if (fields)
+		need += LOGGER_RECORD_MAX;
+	else if (logger.run % (LOGGER_TAG_RUN_MAX + 1) == 0)
+		need++;
+
+	if (logger.len + need + 1 > LOGGER_BLOCK_SIZE)
+		return false;
+
+	if (!fields) {
+		if (logger.run == LOGGER_TAG_RUN_MAX + 1)
+			logger_put_run();
+
+		logger.run++;
+		logger.prev = *rec;
+		return true;
+	}
+
+	logger_put_run();
+	logger.buf[logger.len++] = LOGGER_TAG_DELTA | fields;
+	if (fields & LOGGER_DELTA_TIME)
+		logger_put_varint(zigzag_encode(dt));
+	if (fields & LOGGER_DELTA_LEVEL)
+		logger_put_varint(zigzag_encode(rec->level - prev->level));
+	if (fields & LOGGER_DELTA_RAW_MIN)
+		logger_put_varint(zigzag_encode(rec->raw_min - prev->raw_min));
+	if (fields & LOGGER_DELTA_RAW_MAX)
+		logger_put_varint(zigzag_encode(rec->raw_max - prev->raw_max));
+	if (fields & LOGGER_DELTA_FLAGS)
+		logger.buf[logger.len++] = rec->flags;
+
+	logger.prev = *rec;
+
+	return true;
+}
+
+static void logger_next_page(void)
+{
+	logger.page = (logger.page + 1) % LOGGER_PAGES;
+	logger.len = 0;
+	logger.flashed = 0;
+	logger.run = 0;
+	logger.is_erased = false;
+	if (logger.is_full) {
+		logger.is_full = false;
+		logger_encode(&logger.next);
+	}
+}
+
+// Block in RAM grows while it is decoded by console job
+static unsigned int logger_block_len(struct logger_decoder *d)
+{
+	if (d->data != logger.buf)
+		return d->len;
+
+	if (d->page == logger.page && logger.len)
+		return logger.len;
+
+	// Block was written to flash while it was decoded
+	d->data = (const uint8_t *)logger_addr(d->page);
+	d->len = LOGGER_BLOCK_SIZE;
+
+	return d->len;
+}
+
+static void logger_decode_block(struct logger_decoder *d)
+{
+	const struct logger_block *b;
+
+	d->pos = 0;
+	d->len = 0;
+	d->run = 0;
+	d->is_keyframe = false;
+	if (d->page == logger.page && logger.len) {
+		d->data = logger.buf;
+		d->len = logger.len;
+	} else {
+		d->data = (const uint8_t *)logger_addr(d->page);
+		d->len = LOGGER_BLOCK_SIZE;
+		if (!logger_header_is_valid(d->page) || !logger_crc_is_valid(d->page)) {
+			d->len = 0;
+			return;
+		}
+	}
+
+	b = (const struct logger_block *)d->data;
+
+	d->rec.seq = b->seq;
+	d->rec.time = b->time;
+	d->rec.level = b->level;
+	d->rec.raw_min = b->raw_min;
+	d->rec.raw_max = b->raw_max;
+	d->rec.flags = b->flags;
+	d->period = b->period;
+	d->pos = sizeof(*b);
+	d->is_keyframe = true;
+}
+
+void logger_decode_start(struct logger_decoder *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->page = (logger.page + 1) % LOGGER_PAGES;
+	d->pages_left = LOGGER_PAGES - 1;
+	// Old block of current page is erased before the first write
+	if (!logger.len)
+		d->pages_left--;
+
+	logger_decode_block(d);
+}
+
+static bool logger_get_varint(struct logger_decoder *d, unsigned int len, uint32_t *value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 35 && d->pos < len; shift += 7) {
+		uint8_t ch = d->data[d->pos++];
+
+		*value |= (uint32_t)(ch & 0x7f) << shift;
+		if (!(ch & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+// Returns false on broken data
+static bool logger_decode_delta(struct logger_decoder *d, unsigned int len, uint8_t fields)
+{
+	struct logger_record rec = d->rec;
+	uint32_t value;
+
+	rec.seq++;
+	rec.time += d->period;
+	if (fields & LOGGER_DELTA_TIME) {
+		if (!logger_get_varint(d, len, &value))
+			return false;
+		rec.time += zigzag_decode(value);
+	}
+
+	if (fields & LOGGER_DELTA_LEVEL) {
+		if (!logger_get_varint(d, len, &value))
+			return false;
+		rec.level += zigzag_decode(value);
+	}
+
+	if (fields & LOGGER_DELTA_RAW_MIN) {
+		if (!logger_get_varint(d, len, &value))
+			return false;
+		rec.raw_min += zigzag_decode(value);
+	}
+
+	if (fields & LOGGER_DELTA_RAW_MAX) {
+		if (!logger_get_varint(d, len, &value))
+			return false;
+		rec.raw_max += zigzag_decode(value);
+	}
+
+	if (fields & LOGGER_DELTA_FLAGS) {
+		if (d->pos >= len)
+			return false;
+		rec.flags = d->data[d->pos++];
+	}
+
+	d->rec = rec;
+
+	return true;
+}
+
+bool logger_decode_next(struct logger_decoder *d, struct logger_record *rec)
+{
+	while (true) {
+		unsigned int len;
+		uint8_t tag;
+
+		if (d->is_keyframe) {
+			d->is_keyframe = false;
+			break;
+		}
+
+		if (d->run) {
+			d->run--;
+			d->rec.seq++;
+			d->rec.time += d->period;
+			break;
+		}
+
+		// Pending run of block in RAM is the end of ring
+		if (d->is_tail)
+			return false;
+
+		len = logger_block_len(d);
+		if (d->pos >= len) {
+			if (d->data == logger.buf) {
+				d->run = logger.run;
+				d->is_tail = true;
+				continue;
+			}
+
+			if (!d->pages_left)
+				return false;
+
+			d->page = (d->page + 1) % LOGGER_PAGES;
+			d->pages_left--;
+			logger_decode_block(d);
+			continue;
+		}
+
+		tag = d->data[d->pos++];
+		if (tag == LOGGER_TAG_PAD)
+			continue;
+
+		if (tag <= LOGGER_TAG_RUN_MAX) {
+			d->run = tag + 1;
+			continue;
+		}
+
+		// Rest of broken block is skipped
+		if ((tag & ~(LOGGER_DELTA_FIELDS)) != LOGGER_TAG_DELTA ||
+		    !logger_decode_delta(d, len, tag & LOGGER_DELTA_FIELDS)) {
+			d->pos = len;
+			continue;
+		}
+
+		break;
+	}
+
+	*rec = d->rec;
+
+	return true;
+}
+
+void logger_read(uint32_t offset, uint8_t *buf, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++, offset++) {
+		unsigned int page = (logger.page + 1 + offset / LOGGER_PAGE_SIZE) % LOGGER_PAGES;
+		unsigned int pos = offset % LOGGER_PAGE_SIZE;
+
+		if (page != logger.page)
+			buf[i] = *(const uint8_t *)(logger_addr(page) + pos);
+		else if (pos < logger.len)
+			buf[i] = logger.buf[pos];
+		else if (pos == logger.len && logger.run)
+			buf[i] = logger.run - 1;  // pending run is read as if it was flushed
+		else
+			buf[i] = 0xff;
+	}
+}
+
+void logger_init(void)
+{
+	const struct logger_block *last = NULL;
+	struct logger_decoder d;
+	struct logger_record rec;
+	unsigned int end = 0;
+	unsigned int len;
+
+	memset(&logger, 0, sizeof(logger));
+	logger_reset_interval();
+	logger.flags = LOGGER_BOOT;
+	logger.tick = HAL_GetTick();
+
+	for (unsigned int page = 0; page < LOGGER_PAGES; page++) {
+		const struct logger_block *b = (const struct logger_block *)logger_addr(page);
+
+		if (!logger_header_is_valid(page) || !logger_crc_is_valid(page))
+			continue;
+
+		if (!last || (int32_t)(b->seq - last->seq) > 0) {
+			last = b;
+			logger.page = page;
+		}
+	}
+
+	if (!last)
+		return;
+
+	memset(&d, 0, sizeof(d));
+	d.page = logger.page;
+	logger_decode_block(&d);
+	while (logger_decode_next(&d, &rec)) {
+		logger.prev = rec;
+		end = d.pos;
+	}
+
+	logger.seq = logger.prev.seq + 1;
+	logger.time_base = logger.prev.time;
+	logger.period = last->period;
+
+	// Block is continued only if the rest of page is still erased (write was not interrupted).
+	// The last byte of encoded record is never 0xff
+	len = LOGGER_PAGE_SIZE;
+	while (len > end && ((const uint8_t *)last)[len - 1] == 0xff)
+		len--;
+
+	// Block is closed by CRC
+	if (len != end) {
+		logger_next_page();
+		return;
+	}
+
+	len = (len + 1) & ~1;
+	memset(logger.buf, 0xff, sizeof(logger.buf));
+	memcpy(logger.buf, last, len);
+	logger.len = len;
+	logger.flashed = len;
+	logger.is_erased = true;
+}
+
+void logger_adc(uint16_t raw, uint16_t value, uint8_t flags)
+{
+	logger.level = value;
+	if (raw < logger.raw_min)
+		logger.raw_min = raw;
+	if (raw > logger.raw_max)
+		logger.raw_max = raw;
+
+	logger.flags |= flags;
+}
+
+// Called from flash interrupt
+static void logger_write_done(struct flash_job *job, int res)
+{
+	logger.is_write_failed = !!res;
+	logger.is_writing = false;
+}
+
+static void logger_flush(void)
+{
+	struct flash_job *erase = &logger.erase_job;
+	struct flash_job *program = &logger.program_job;
+
+	if (logger.is_writing)
+		return;
+
+	// Flash is programmed by halfwords, so block is closed here and continued after padding
+	logger_put_run();
+	if (logger.len & 1)
+		logger.buf[logger.len++] = LOGGER_TAG_PAD;
+
+	if (logger.flashed == logger.len && !logger.is_full)
+		return;
+
+	logger.is_writing = true;
+	logger.write_end = logger.len;
+	// Full block is programmed up to the end of page with its CRC. Erased flash can be programmed
+	// by 0xffff, so the gap before CRC is programmed too
+	if (logger.is_full) {
+		uint32_t crc = crc_calc(logger.buf, LOGGER_BLOCK_SIZE / 4);
+
+		memcpy(&logger.buf[LOGGER_BLOCK_SIZE], &crc, sizeof(crc));
+		logger.write_end = LOGGER_PAGE_SIZE;
+	}
+
+	if (!logger.is_erased) {
+		memset(erase, 0, sizeof(*erase));
+		erase->type = FLASH_JOB_ERASE;
+		erase->addr = logger_addr(logger.page);
+		// Failed erase is found by verify of program job
+		if (!flash_job_submit(erase))
+			logger.is_erased = true;
+	}
+
+	memset(program, 0, sizeof(*program));
+	program->type = FLASH_JOB_PROGRAM;
+	program->addr = logger_addr(logger.page) + logger.flashed;
+	program->data = &logger.buf[logger.flashed];
+	program->len = logger.write_end - logger.flashed;
+	program->done = logger_write_done;
+	if (!logger.is_erased || flash_job_submit(program)) {
+		logger.is_writing = false;
+		logger.is_write_failed = true;
+	}
+}
+
+static void logger_add_record(bool is_ignition_off)
+{
+	struct logger_record rec;
+
+	if (logger.is_full) {
+		logger.dropped++;
+		logger_reset_interval();
+		return;
+	}
+
+	rec.seq = logger.seq++;
+	rec.time = logger.time_base + HAL_GetTick() / 1000;
+	rec.level = logger.level;
+	rec.raw_min = logger.raw_min;
+	rec.raw_max = logger.raw_max;
+	rec.flags = logger.flags;
+	if (is_ignition_off)
+		rec.flags |= LOGGER_IGNITION_OFF;
+
+	if (!logger_encode(&rec)) {
+		logger.next = rec;
+		logger.is_full = true;
+	}
+
+	logger_reset_interval();
+}
+
+void logger_process(bool is_ignition_off)
+{
+	uint32_t tick = HAL_GetTick();
+
+	if (!logger.is_writing && logger.write_end) {
+		if (logger.is_write_failed) {
+			// Page can't be programmed: records of block are lost, the next one starts new block
+			logger_next_page();
+		} else {
+			logger.flashed = logger.write_end;
+			if (logger.is_full)
+				logger_next_page();
+		}
+
+		logger.write_end = 0;
+		logger.is_write_failed = false;
+	}
+
+	if (env_log_period && tick - logger.tick >= env_log_period * 1000) {
+		logger.tick = tick;
+		logger_add_record(is_ignition_off);
+	}
+
+	if (logger.is_full || (is_ignition_off && !logger.was_ignition_off))
+		logger_flush();
+
+	logger.was_ignition_off = is_ignition_off;
+}
+
+static void logger_print_time(uint8_t num, uint32_t time)
+{
+	usart_printf(num, "%u:%02u:%02u", time / 3600, (time / 60) % 60, time % 60);
+}
+
+// Ring is decoded from the oldest record, job->arg and job->ptr are bounds of time
+static int log_read_step(uint8_t num, struct console_job *job)
+{
+	struct logger_decoder *d = (struct logger_decoder *)job->state;
+	uint32_t from = job->arg;
+	uint32_t to = (uintptr_t)job->ptr;
+	unsigned int lines = 0;
+	struct logger_record rec;
+
+	if (!job->pos) {
+		usart_puts(num, "     seq      time  level  raw_min  raw_max  flags\n");
+		logger_decode_start(d);
+		job->pos = 1;
+	}
+
+	// Both printed and skipped records are bounded per step
+	for (unsigned int i = 0; i < LOGGER_READ_SCAN && lines < LOGGER_READ_LINES; i++) {
+		if (!logger_decode_next(d, &rec))
+			return CONSOLE_JOB_DONE;
+
+		if (rec.time < from || rec.time > to)
+			continue;
+
+		usart_printf(num, "%8u  ", rec.seq);
+		logger_print_time(num, rec.time);
+		usart_printf(num, "  %5u  %7u  %7u  %#x\n", rec.level, rec.raw_min, rec.raw_max, rec.flags);
+		lines++;
+	}
+
+	return CONSOLE_JOB_AGAIN;
+}
+
+static int cmd_log_read(uint8_t num, int argc, char *argv[])
+{
+	var_from_str(from, argv[0]);
+	uint32_t to = 0xffffffff;
+
+	if (argc > 1) {
+		var_from_str(value, argv[1]);
+		to = value;
+	}
+
+	return console_job_start(num, log_read_step, from, (void *)(uintptr_t)to);
+}
+CONSOLE_CMD(log_read, cmd_log_read, 1, 2, "вывести записи журнала уровня топлива со временем работы от arg1 до arg2 секунд (смотри log_info)");
+
+// State of log_info job, it must fit into job->state
+struct log_info_state {
+	union {
+		struct logger_decoder d;  // records are decoded first
+		struct {
+			uint16_t blocks;  // then pages are checked
+			uint16_t broken;
+		} pages;
+	};
+	uint32_t count;
+	uint32_t first_seq;
+	uint32_t first_time;
+	uint32_t last_seq;
+	uint32_t last_time;
+};
+
+// job->pos is 1 while records are decoded, then it is the next page to check plus 2
+static int log_info_step(uint8_t num, struct console_job *job)
+{
+	struct log_info_state *s = (struct log_info_state *)job->state;
+	struct logger_record rec;
+
+	if (!job->pos) {
+		logger_decode_start(&s->d);
+		job->pos = 1;
+	}
+
+	if (job->pos == 1) {
+		for (unsigned int i = 0; i < LOGGER_READ_SCAN; i++) {
+			if (!logger_decode_next(&s->d, &rec)) {
+				s->pages.blocks = 0;
+				s->pages.broken = 0;
+				job->pos = 2;
+				break;
+			}
+
+			if (!s->count) {
+				s->first_seq = rec.seq;
+				s->first_time = rec.time;
+			}
+
+			s->last_seq = rec.seq;
+			s->last_time = rec.time;
+			s->count++;
+		}
+
+		return CONSOLE_JOB_AGAIN;
+	}
+
+	for (unsigned int i = 0; i < LOGGER_INFO_PAGES && job->pos - 2 < LOGGER_PAGES;
+	     i++, job->pos++) {
+		if (!logger_header_is_valid(job->pos - 2))
+			continue;
+
+		if (logger_crc_is_valid(job->pos - 2))
+			s->pages.blocks++;
+		else
+			s->pages.broken++;
+	}
+
+	if (job->pos - 2 < LOGGER_PAGES)
+		return CONSOLE_JOB_AGAIN;
+
+	if (s->count) {
+		usart_printf(num, "first:    seq %u, time ", s->first_seq);
+		logger_print_time(num, s->first_time);
+		usart_printf(num, "\nlast:     seq %u, time ", s->last_seq);
+		logger_print_time(num, s->last_time);
+		usart_putc(num, '\n');
+	}
+
+	usart_printf(num, "records:  %u\n", s->count);
+	usart_printf(num, "pages:    %u of %u (%u with wrong CRC)\n", s->pages.blocks, LOGGER_PAGES,
+		     s->pages.broken);
+	usart_printf(num, "block:    %u of %u bytes, %u in flash\n", logger.len, LOGGER_PAGE_SIZE, logger.flashed);
+	usart_printf(num, "dropped:  %u\n", logger.dropped);
+	usart_puts(num, "time:     ");
+	logger_print_time(num, logger.time_base + HAL_GetTick() / 1000);
+	usart_printf(num, " (%u s)\n", logger.time_base + HAL_GetTick() / 1000);
+
+	return CONSOLE_JOB_DONE;
+}
+
+static int cmd_log_info(uint8_t num, int argc, char *argv[])
+{
+	return console_job_start(num, log_info_step, 0, NULL);
+}
+CONSOLE_CMD(log_info, cmd_log_info, 0, 0, "вывести состояние журнала уровня топлива и текущее время работы");
@@ -0,0 +1,96 @@
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Fuel level history in free flash after application (its size is 56K in linker script).
+// Every page is one block of records: header with the first record (keyframe) and then encoded
+// changes of the next records. Block is collected in RAM, every page is erased once and programmed
+// in background. Full page is closed by CRC-32 of block (crc_calc) in its last word
+#define LOGGER_ADDR		0x08010000
+#define LOGGER_PAGE_SIZE	0x400
+#define LOGGER_BLOCK_SIZE	(LOGGER_PAGE_SIZE - 4)
+#define LOGGER_PAGES		58  // up to environment log
+#define LOGGER_SIZE		(LOGGER_PAGES * LOGGER_PAGE_SIZE)
+
+#define LOGGER_BLOCK_MAGIC	0x4c47
+
+// Flags of record
+#define LOGGER_ALERT		BIT(0)  // low fuel LED was on
+#define LOGGER_IGNITION_OFF	BIT(1)  // interval ended with ignition off
+#define LOGGER_ADC_DEBUG	BIT(2)  // values are set by set_adc
+#define LOGGER_BOOT		BIT(3)  // first record after power on
+
+// Encoding of records after block header. Every record starts with tag:
+// 0x00..0x7f - tag + 1 records equal to previous one with time + period
+// 0x80..0x9f - one record, bits of LOGGER_DELTA_* are fields which follow in order of bits
+// 0xff - padding (flash is programmed by halfwords), erased flash is the end of block
+#define LOGGER_TAG_RUN_MAX	0x7f
+#define LOGGER_TAG_DELTA	0x80
+#define LOGGER_TAG_PAD		0xff
+
+#define LOGGER_DELTA_TIME	BIT(0)  // zig-zag varint: time - previous time - period
+#define LOGGER_DELTA_LEVEL	BIT(1)  // zig-zag varint: level - previous level
+#define LOGGER_DELTA_RAW_MIN	BIT(2)  // zig-zag varint
+#define LOGGER_DELTA_RAW_MAX	BIT(3)  // zig-zag varint
+#define LOGGER_DELTA_FLAGS	BIT(4)  // uint8_t as is
+#define LOGGER_DELTA_FIELDS	0x1f
+
+#define LOGGER_RECORD_MAX	(1 + 5 + 3 * 3 + 1)  // tag and all fields
+
+struct logger_record {
+	uint32_t seq;  // increases by 1 for every record and continues after reboot
+	uint32_t time;  // seconds of operation: uptime counted from time of the last saved record
+	uint16_t level;  // filtered ADC value at the end of interval
+	uint16_t raw_min;  // samples before filter over the interval
+	uint16_t raw_max;
+	uint8_t flags;  // LOGGER_*
+};
+
+// Beginning of every page
+struct logger_block {
+	uint16_t magic;
+	uint16_t period;  // expected time between records
+	uint32_t seq;
+	uint32_t time;
+	uint16_t level;
+	uint16_t raw_min;
+	uint16_t raw_max;
+	uint8_t flags;
+	uint8_t check;
+} __attribute__((packed));
+
+// Streaming decoder of log from the oldest block. Records which are still in RAM are decoded too.
+// It fits into state of console job
+struct logger_decoder {
+	const uint8_t *data;
+	unsigned int len;
+	unsigned int pos;
+	unsigned int page;
+	unsigned int pages_left;
+	unsigned int run;  // records left in current run
+	uint16_t period;
+	bool is_keyframe;  // the next record is in block header
+	bool is_tail;  // pending run of block in RAM is decoded, it is the end of ring
+	struct logger_record rec;
+};
+
+// Finds the end of saved records
+void logger_init(void);
+// Called for every ADC sample
+void logger_adc(uint16_t raw, uint16_t value, uint8_t flags);
+// Called from main loop: adds record every log_period seconds. Buffered records are written when
+// page is full or ignition is turned off
+void logger_process(bool is_ignition_off);
+
+void logger_decode_start(struct logger_decoder *d);
+// Returns false after the last record
+bool logger_decode_next(struct logger_decoder *d, struct logger_record *rec);
+// Copies encoded blocks as they are ordered from the oldest page, offset is up to LOGGER_SIZE.
+// Current block is read from RAM, erased flash is read as 0xff
+void logger_read(uint32_t offset, uint8_t *buf, unsigned int len);
+
+#endif  // _LOGGER_H
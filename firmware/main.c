@@ -7,48 +7,58 @@
 #include "stm32f1xx_hal_conf.h"
 
 #include "adc.h"
+#include "bulk.h"
 #include "common.h"
+#include "console.h"
+#include "crc.h"
 #include "delay.h"
+#include "env.h"
+#include "exti.h"
 #include "flash.h"
+#include "format.h"
 #include "gpio.h"
+#include "integrity.h"
+#include "logger.h"
+#include "monitor.h"
+#include "motor.h"
+#include "nvic.h"
+#include "position.h"
+#include "proto.h"
+#include "pwr.h"
 #include "rcc.h"
+#include "telemetry.h"
+#include "timer.h"
 #include "usart.h"
 
 
 #define GPIO_LED_SMALL	GEN_GPIO(BANK_GPIOC, 13)
-#define GPIO_STEP	GEN_GPIO(BANK_GPIOB, 1)
-#define GPIO_DIR	GEN_GPIO(BANK_GPIOB, 0)
+#define GPIO_FUEL_STEP	GEN_GPIO(BANK_GPIOB, 1)
+#define GPIO_FUEL_DIR	GEN_GPIO(BANK_GPIOB, 0)
+#define GPIO_FUEL_DIAG	GEN_GPIO(BANK_GPIOB, 12)  // TMC2209 DIAG output (StallGuard)
 #define USART1_TX	GEN_GPIO(BANK_GPIOA, 9)
 #define USART1_RX	GEN_GPIO(BANK_GPIOA, 10)
+#define USART2_TX	GEN_GPIO(BANK_GPIOA, 2)
+#define USART2_RX	GEN_GPIO(BANK_GPIOA, 3)
 #define LED_ALARM	GEN_GPIO(BANK_GPIOB, 13)
 #define GPIO_ENABLE	GEN_GPIO(BANK_GPIOA, 6)
 
-#define UART_NUM 1
+#define UART_NUM 1  // main console: boot messages, baudrate from environment
+#define UART_PCLK 72000000  // USART1 is on APB2
+#define UART2_NUM 2  // second console (for permanently attached logger)
+#define UART2_PCLK 36000000  // USART2 is on APB1
+#define MOTOR_TIMER_NUM 2
 
 #define ADC_RUN_PERIOD		100
 #define ADC_START_TIMEOUT	10
+#define ADC_INFO_LINE		16  // values per line of adc_info
 
-// Last page of flash
-#define ENV_ADDR	0x0801fc00
-#define ENV_MAGIC	0x564e45aa
+#define POSITION_SAVE_DELAY	2000  // ms at rest before position is saved
+#define POSITION_SAVE_PERIOD	60000  // ms between saves while ignition is on
 
-#define ESC_UP		0x5b41
-#define ESC_DOWN	0x5b42
-#define ESC_RIGHT	0x5b43
-#define ESC_LEFT	0x5b44
+#define LOOP_STATS_PERIOD	1000  // ms
 
-#define ESC_INS		0x5b327e
-#define ESC_DEL		0x5b337e
-#define ESC_PGUP	0x5b357e
-#define ESC_PGDOWN	0x5b367e
-
-#define ESC_END		0x5b46
-#define ESC_END2	0x4f46
-#define ESC_HOME	0x5b48
-#define ESC_HOME2	0x5b317e
-
-#define ESC_F1		0x4f50
-#define ESC_F2		0x4f51
+#define ADC_MAX		4095  // 12-bit ADC
+#define STEPS_MAX	32767  // position is saved as int16_t
 
 #define DEFAULT_ADC_OVEREMPTY	400
 #define DEFAULT_ADC_EMPTY	800
@@ -58,54 +68,15 @@
 #define DEFAULT_STEPS_FULL	1550
 #define DEFAULT_STEPS_TOTAL	2000
 #define DEFAULT_USE_EMA_FILTER	1
-
-#define ENV_ADC_OVEREMPTY	0
-#define ENV_ADC_EMPTY		1
-#define ENV_ADC_FULL		2
-#define ENV_ADC_ALERT		3
-#define ENV_STEPS_EMPTY		4
-#define ENV_STEPS_FULL		5
-#define ENV_STEPS_TOTAL		6
-#define ENV_USE_EMA_FILTER	7
-
-#define var_from_str(v, argv) uint32_t v; \
-	do { \
-		bool ok; \
-		v = str_to_uint32(argv, &ok); \
-		if (!ok) { \
-			usart_printf(num, "Error: Argument '%s' is not an integer\n", argv); \
-			return -1; \
-		} \
-	} while (0)
-
-
-struct command {
-	char *cmd;
-	int (*func)(uint8_t num, int argc, char *argv[]);
-	uint8_t arg_min;
-	uint8_t arg_max;
-	char *help;
-};
-
-struct env_record {
-	char *name;
-	uint32_t value;
-	char *help;
-};
-
-struct motor {
-	uint32_t current;
-	uint32_t target;
-	uint32_t set_dir_tick;
-	uint32_t step_tick;
-	bool step_is_high;
-	bool dir_is_forward;
-	bool is_debug;
-};
+#define DEFAULT_USE_STALLGUARD	1
+#define DEFAULT_HOME_PERIOD	20
+#define DEFAULT_BACKLASH	0
+#define DEFAULT_DIR_HYSTERESIS	3
 
 struct adc {
 	uint16_t values[100];
 	uint32_t value;
+	uint32_t raw;  // last sample before filter
 	uint32_t run_tick;
 	int values_pos;
 	bool is_debug;
@@ -114,66 +85,112 @@ struct adc {
 	bool is_values_wrapped;
 };
 
-struct console {
-	char line[64];
-	char history[4][64];
-	int line_pos;
-	int line_size;
-	int history_pos;
-	int history_size;
-	int history_sel;
-	bool is_esc_seq;
-	uint32_t esc_seq;
-	unsigned int esc_seq_pos;
+struct position {
+	uint32_t rest_tick;
+	uint32_t save_tick;
+	uint16_t warm_boots;
+	bool is_lost;
+	volatile bool is_power_low;
 };
 
-int cmd_help(uint8_t num, int argc, char *argv[]);
-int cmd_printenv(uint8_t num, int argc, char *argv[]);
-int cmd_setenv(uint8_t num, int argc, char *argv[]);
-int cmd_saveenv(uint8_t num, int argc, char *argv[]);
-int cmd_loadenv(uint8_t num, int argc, char *argv[]);
-int cmd_delenv(uint8_t num, int argc, char *argv[]);
-int cmd_reset(uint8_t num, int argc, char *argv[]);
-int cmd_get_adc(uint8_t num, int argc, char *argv[]);
-int cmd_set_adc(uint8_t num, int argc, char *argv[]);
-int cmd_debug_adc(uint8_t num, int argc, char *argv[]);
-int cmd_debug_motor(uint8_t num, int argc, char *argv[]);
-int cmd_get_motor(uint8_t num, int argc, char *argv[]);
-int cmd_set_motor(uint8_t num, int argc, char *argv[]);
-int cmd_adc_info(uint8_t num, int argc, char *argv[]);
-int cmd_motor_info(uint8_t num, int argc, char *argv[]);
-int cmd_park(uint8_t num, int argc, char *argv[]);
-
-struct command cmds[] = {
-	{ "help", cmd_help, 0, 0, },
-	{ "printenv", cmd_printenv, 0, 1, "вывести все переменные окружения (если arg1 не указан) или вывести переменную, указанную в arg1", },
-	{ "setenv", cmd_setenv, 2, 2, "указать новое целочисленное значение arg1 для переменной окружения arg1", },
-	{ "saveenv", cmd_saveenv, 0, 0, "сохранить все переменные окружения во внутреннюю Flash-память", },
-	{ "loadenv", cmd_loadenv, 0, 0, "загрузить ранее сохранённые переменные окружения", },
-	{ "delenv", cmd_delenv, 0, 0, "очистить сохранённые переменные окружения во Flash-памяти... после перезагрузки будут использоваться занчения по умолчанию", },
-	{ "reset", cmd_reset, 0, 0, "программная перезагрузка микроконтроллера", },
-	{ "get_adc", cmd_get_adc, 0, 0, "вывести текущее значения АЦП", },
-	{ "set_adc", cmd_set_adc, 1, 1, "изменить текущее значение АЦП на указанное в arg1 (смотри debug_adc)", },
-	{ "debug_adc", cmd_debug_adc, 1, 1, "если arg1 != 0, то остановить работу АЦП... менять значения АЦП можно командой set_adc", },
-	{ "debug_motor", cmd_debug_motor, 1, 1, "если arg1 != 0, то остановить автоматическое управление шаговым двигателем... требуется для set_motor", },
-	{ "get_motor", cmd_get_motor, 0, 0, "вывести текущую позицию шагового двигателя", },
-	{ "set_motor", cmd_set_motor, 1, 1, "указать текущую позицию шагового двигателя (смотри debug_motor)", },
-	{ "adc_info", cmd_adc_info, 0, 0, "вывести полную информацию об АЦП", },
-	{ "motor_info", cmd_motor_info, 0, 0, "вывести полную информацию об управлении шаговым двигателем", },
-	{ "park", cmd_park, 1, 1, "парковка шагового двигателя в крайнее положене", },
+// Main loop timing in the last LOOP_STATS_PERIOD
+struct loop_stats {
+	uint32_t tick;
+	uint32_t window_tick;
+	uint32_t count;
+	uint32_t max_us;
+	uint32_t rate;  // loops per LOOP_STATS_PERIOD
+	uint32_t window_max_us;
 };
-struct console console;
-struct motor motor;
+
+struct console consoles[] = {
+	{ .num = UART_NUM, .pclk = UART_PCLK, },
+	{ .num = UART2_NUM, .pclk = UART2_PCLK, },
+};
+struct loop_stats loop;
 struct adc adc;
-struct env_record env[] = {
-	{ "adc_overempty", DEFAULT_ADC_OVEREMPTY, "значение АЦП, до которого можно опускать стрелку", },
-	{ "adc_empty", DEFAULT_ADC_EMPTY, "значение АЦП, соответствующее пустому баку", },
-	{ "adc_full", DEFAULT_ADC_FULL, "значение АЦП, соответствующее полному баку", },
-	{ "adc_alert", DEFAULT_ADC_ALERT, "значение АЦП, при котором горит светодиод", },
-	{ "steps_empty", DEFAULT_STEPS_EMPTY, "количество шагов до отметки пустого бака", },
-	{ "steps_full", DEFAULT_STEPS_FULL, "количество шагов до отметки полного бака", },
-	{ "steps_total", DEFAULT_STEPS_TOTAL, "полное количество шагов до конца", },
-	{ "use_ema_filter", DEFAULT_USE_EMA_FILTER, "0 - не фильтровать значения с АЦП, 1 - использовать фильтр EMA", },
+struct position position;
+ENV_VAR(adc_overempty, ENV_SLOT_ADC_OVEREMPTY, DEFAULT_ADC_OVEREMPTY, 0, ADC_MAX, NULL, "значение АЦП, до которого можно опускать стрелку");
+ENV_VAR(adc_empty, ENV_SLOT_ADC_EMPTY, DEFAULT_ADC_EMPTY, 0, ADC_MAX, NULL, "значение АЦП, соответствующее пустому баку");
+ENV_VAR(adc_full, ENV_SLOT_ADC_FULL, DEFAULT_ADC_FULL, 0, ADC_MAX, NULL, "значение АЦП, соответствующее полному баку");
+ENV_VAR(adc_alert, ENV_SLOT_ADC_ALERT, DEFAULT_ADC_ALERT, 0, ADC_MAX, NULL, "значение АЦП, при котором горит светодиод");
+ENV_VAR(steps_empty, ENV_SLOT_STEPS_EMPTY, DEFAULT_STEPS_EMPTY, 0, STEPS_MAX, "шаг", "количество шагов до отметки пустого бака");
+ENV_VAR(steps_full, ENV_SLOT_STEPS_FULL, DEFAULT_STEPS_FULL, 0, STEPS_MAX, "шаг", "количество шагов до отметки полного бака");
+ENV_VAR(steps_total, ENV_SLOT_STEPS_TOTAL, DEFAULT_STEPS_TOTAL, 1, STEPS_MAX, "шаг", "полное количество шагов до конца");
+ENV_BOOL(use_ema_filter, ENV_SLOT_USE_EMA_FILTER, DEFAULT_USE_EMA_FILTER, "0 - не фильтровать значения с АЦП, 1 - использовать фильтр EMA");
+ENV_BOOL(use_stallguard, ENV_SLOT_USE_STALLGUARD, DEFAULT_USE_STALLGUARD, "0 - парковка на steps_total шагов, 1 - останавливать парковку по сигналу DIAG драйвера (StallGuard)");
+ENV_VAR(home_period, ENV_SLOT_HOME_PERIOD, DEFAULT_HOME_PERIOD, 0, 0xffff, "вкл.", "сколько раз подряд при включении можно восстанавливать сохранённую позицию стрелок без парковки (0 - всегда парковать)");
+ENV_VAR(backlash, ENV_SLOT_BACKLASH, DEFAULT_BACKLASH, 0, 1000, "шаг", "количество дополнительных шагов при смене направления движения стрелки для выборки люфта редуктора");
+ENV_VAR(dir_hysteresis, ENV_SLOT_DIR_HYSTERESIS, DEFAULT_DIR_HYSTERESIS, 0, 1000, "шаг", "изменение позиции стрелки назад (против последнего направления движения) меньше, чем на это количество шагов, игнорируется");
+
+// fuel_get_target() relies on these checks: ranges are never empty or inverted
+static const char *check_adc(void)
+{
+	if (env_adc_overempty > env_adc_empty || env_adc_empty >= env_adc_full)
+		return "adc_overempty <= adc_empty < adc_full is required";
+
+	return NULL;
+}
+ENV_CHECK(adc, check_adc);
+
+static const char *check_steps(void)
+{
+	if (env_steps_empty >= env_steps_full || env_steps_full > env_steps_total)
+		return "steps_empty < steps_full <= steps_total is required";
+
+	return NULL;
+}
+ENV_CHECK(steps, check_steps);
+
+static bool fuel_get_target(struct motor *m, int32_t *target);
+
+// Other gauges of the cluster (speed, tach, temperature) are added here with own pins,
+// calibration and target source. All of them are serviced by one timer tick.
+struct motor motors[] = {
+	{
+		.name = "fuel",
+		.gpio_step = GPIO_FUEL_STEP,
+		.gpio_dir = GPIO_FUEL_DIR,
+		.gpio_diag = GPIO_FUEL_DIAG,
+		.steps_total = &env_steps_total,
+		.backlash = &env_backlash,
+		.hysteresis = &env_dir_hysteresis,
+		.get_target = fuel_get_target,
+	},
+};
+
+static uint8_t proto_adc(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+static uint8_t proto_motor(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+
+const struct proto_handler proto_handlers[] = {
+	{ PROTO_MSG_BAUDRATE, 4, console_proto_baudrate, },
+	{ PROTO_MSG_ENV_GET, 1, env_proto_get, },
+	{ PROTO_MSG_ENV_SET, 5, env_proto_set, },
+	{ PROTO_MSG_ENV_SAVE, 0, env_proto_save, },
+	{ PROTO_MSG_ADC, 0, proto_adc, },
+	{ PROTO_MSG_MOTOR, 1, proto_motor, },
+	{ PROTO_MSG_SUBSCRIBE, 3, telemetry_subscribe, },
+	{ PROTO_MSG_READ, sizeof(struct proto_read), bulk_proto_read, },
+	{ PROTO_MSG_READ_ACK, 5, bulk_proto_ack, },
+};
+
+static void monitor_print_uint(char *buf, unsigned int size, void *arg);
+static void monitor_print_int(char *buf, unsigned int size, void *arg);
+static void monitor_print_alert(char *buf, unsigned int size, void *arg);
+static void monitor_print_motor_state(char *buf, unsigned int size, void *arg);
+static void monitor_print_uptime(char *buf, unsigned int size, void *arg);
+
+// Values of motor fields are for the first motor (fuel)
+const struct monitor_field monitor_fields[] = {
+	{ 3, 1, 8, "adc_raw:     ", monitor_print_uint, &adc.raw, },
+	{ 4, 1, 8, "adc_value:   ", monitor_print_uint, &adc.value, },
+	{ 5, 1, 8, "alert:       ", monitor_print_alert, NULL, },
+	{ 3, 30, 8, "target:     ", monitor_print_int, (void *)&motors[0].target, },
+	{ 4, 30, 8, "current:    ", monitor_print_int, (void *)&motors[0].current, },
+	{ 5, 30, 16, "state:      ", monitor_print_motor_state, &motors[0], },
+	{ 7, 1, 8, "loops/s:     ", monitor_print_uint, &loop.rate, },
+	{ 8, 1, 8, "loop_max_us: ", monitor_print_uint, &loop.window_max_us, },
+	{ 7, 30, 12, "uptime:     ", monitor_print_uptime, NULL, },
 };
 
 static void Error_Handler(void)
@@ -182,11 +199,58 @@ static void Error_Handler(void)
 	}
 }
 
-void SysTick_Handler(void)
+extern volatile uint32_t uwTick;
+extern uint32_t _vtor[];
+extern uint32_t _sidata[];
+extern uint32_t _sdata[];
+extern uint32_t _edata[];
+
+// Vector table is fetched from RAM, so RAMFUNC handlers are taken while flash is busy
+static uint32_t ram_vectors[NVIC_VECTORS] __attribute__((aligned(256)));
+
+// Overrides of weak HAL functions: tick is counted and read by interrupts while flash is busy
+RAMFUNC void HAL_IncTick(void)
+{
+	uwTick += uwTickFreq;
+}
+
+RAMFUNC uint32_t HAL_GetTick(void)
+{
+	return uwTick;
+}
+
+RAMFUNC void SysTick_Handler(void)
 {
 	HAL_IncTick();
 }
 
+RAMFUNC void TIM2_IRQHandler(void)
+{
+	timer_clear_update(MOTOR_TIMER_NUM);
+	motor_tick();
+}
+
+RAMFUNC void EXTI15_10_IRQHandler(void)
+{
+	motor_stall_irq();
+}
+
+void PVD_IRQHandler(void)
+{
+	exti_clear_pending(EXTI_LINE_PVD);
+	if (pwr_pvd_is_low()) {
+		// Supply is falling: stop needles and save where they are while flash still can be programmed
+		timer_stop(MOTOR_TIMER_NUM);
+		position.is_power_low = true;
+		if (!position.is_lost)
+			position_save_emergency(motors, ARRAY_SIZE(motors), position.warm_boots);
+	} else {
+		// Supply is restored after short drop
+		position.is_power_low = false;
+		timer_start(MOTOR_TIMER_NUM);
+	}
+}
+
 static void SystemClock_Config(void)
 {
 	RCC_ClkInitTypeDef clkinitstruct = {
@@ -223,578 +287,399 @@ static void SystemClock_Config(void)
 		Error_Handler();
 }
 
-static uint32_t str_to_uint32(char *s, bool *ok)
-{
-	int base = 10;
-	uint32_t value = 0;
-
-	if (s[0] == '0') {
-		switch (s[1]) {
-		case 'x':
-			base = 16;
-			s = s + 2;
-			break;
-		case 'o':
-			base = 8;
-			s = s + 2;
-			break;
-		case 'b':
-			base = 2;
-			s = s + 2;
-			break;
-		default:
-			break;
-		}
-	}
-
-	while (*s) {
-		uint8_t tmp = *s;
-
-		value *= base;
-		if (base == 16) {
-			if (tmp >= 'A' && tmp <= 'F')
-				tmp = tmp - 'A' + 10;
-			else if (tmp >= 'a' && tmp <= 'f')
-				tmp = tmp - 'a' + 10;
-		} else
-			tmp -= '0';
-
-		if (tmp >= base) {
-			if (ok)
-				*ok = false;
+// Park all motors (to the end stop if is_full, otherwise by current position) and wait
+static void motors_park(uint8_t num, bool is_full)
+{
+	bool use_stallguard = !!env_use_stallguard;
 
-			return value;
-		}
+	for (int i = 0; i < ARRAY_SIZE(motors); i++)
+		motor_park(&motors[i], is_full ? *motors[i].steps_total : motors[i].current, use_stallguard);
 
-		value += tmp;
-		s++;
+	while (motor_is_parking()) {
 	}
 
-	if (ok)
-		*ok = true;
+	for (int i = 0; i < ARRAY_SIZE(motors); i++)
+		usart_printf(num, "%s: parked in %u steps\n", motors[i].name, motors[i].park_done);
 
-	return value;
+	if (is_full)
+		position.is_lost = false;
 }
 
-static int env_load(void)
+// Motor is selected by name in argv[idx] or the first one is used
+static struct motor *motor_from_arg(uint8_t num, int argc, char *argv[], int idx)
 {
-	int len;
+	struct motor *m;
 
-	if (readl(ENV_ADDR) != ENV_MAGIC)
-		return -1;
+	if (argc <= idx)
+		return &motors[0];
 
-	len = readl(ENV_ADDR + 0x4);
-	if (len < 0 || len > 128)
-		return -1;
+	m = motor_find(argv[idx]);
+	if (!m)
+		usart_printf(num, "Error: Motor '%s' is not found\n", argv[idx]);
 
-	if (ARRAY_SIZE(env) < len)
-		len = ARRAY_SIZE(env);
+	return m;
+}
 
-	for (int i = 0; i < len; i++)
-		env[i].value = readl(ENV_ADDR + 0x10 + (i * 0x4));
+static int cmd_reset(uint8_t num, int argc, char *argv[])
+{
+	uint32_t value;
+
+	usart_puts(num, "Resetting...\n");
+	usart_flush(num);
+	value = readl(0xe000ed0c);  // SCB_AIRCR register
+	value = (value & 0xffff) | (0x5fa << 16);  // VECTKEY required to write to this register
+	value |= BIT(2);  // SYSRESETREQ
+	writel(value, 0xe000ed0c);
 
 	return 0;
 }
+CONSOLE_CMD(reset, cmd_reset, 0, 0, "программная перезагрузка микроконтроллера");
 
-static int env_save(void)
+static int cmd_get_adc(uint8_t num, int argc, char *argv[])
 {
-	uint32_t data[ARRAY_SIZE(env) + 4];
-	int res;
-	int retry = 3;
-
-	data[0] = ENV_MAGIC;
-	data[1] = ARRAY_SIZE(env);
-	data[2] = 0xffffffff;  // reserved
-	data[3] = 0xffffffff;  // reserved
-	for (int i = 0; i < ARRAY_SIZE(env); i++)
-		data[i + 4] = env[i].value;
-
-	res = flash_erase_page(ENV_ADDR);
-	if (res)
-		return res;
-
-	do {
-		retry--;
-		res = flash_program(ENV_ADDR, data, sizeof(data));
-		if (!res)
-			res = flash_verify(ENV_ADDR, data, sizeof(data));
-	} while (res && retry);
+	usart_printf(num, "%d\n", adc.value);
 
 	return 0;
 }
+CONSOLE_CMD(get_adc, cmd_get_adc, 0, 0, "вывести текущее значения АЦП");
 
-static void print_help_text(uint8_t num, char *s)
+static int cmd_set_adc(uint8_t num, int argc, char *argv[])
 {
-	int col = 4;
+	var_from_str(value, argv[0]);
 
-	usart_puts(num, "          ");
-	while (*s) {
-		if (((uint8_t)*s & 0xc0) != 0x80)  // if ASCII or first byte of UTF-8 symbol
-			col++;
+	adc.value = value;
+	gpio_pin_set(LED_ALARM, !!(adc.value < env_adc_alert));
+	logger_adc(value, value, LOGGER_ADC_DEBUG | (adc.value < env_adc_alert ? LOGGER_ALERT : 0));
 
-		if ((*s == ' ' && col >= 80) || (*s == '\n')) {
-			usart_puts(num, "\n          ");
-			col = 4;
-		} else {
-			usart_putc(num, *s);
-		}
 
-		s++;
-	}
-	usart_putc(num, '\n');
+	return 0;
 }
+CONSOLE_CMD(set_adc, cmd_set_adc, 1, 1, "изменить текущее значение АЦП на указанное в arg1 (смотри debug_adc)");
 
-static void motor_set_dir(bool is_forward)
+static int cmd_debug_adc(uint8_t num, int argc, char *argv[])
 {
-	motor.dir_is_forward = is_forward;
-	motor.set_dir_tick = HAL_GetTick();
-	gpio_pin_set(GPIO_DIR, (uint32_t)is_forward);
-}
+	var_from_str(value, argv[0]);
 
-static void motor_set_step(bool high)
-{
-	motor.step_is_high = high;
-	motor.step_tick = HAL_GetTick();
-	gpio_pin_set(GPIO_STEP, (uint32_t)high);
-	if (high)
-		motor.current += motor.dir_is_forward ? 1 : -1;
+	adc.is_debug = !!value;
+
+	return 0;
 }
+CONSOLE_CMD(debug_adc, cmd_debug_adc, 1, 1, "если arg1 != 0, то остановить работу АЦП... менять значения АЦП можно командой set_adc");
 
-static void motor_park(int steps)
+static int cmd_debug_motor(uint8_t num, int argc, char *argv[])
 {
-	motor_set_dir(false);
-	HAL_Delay(1);
-	for (int i = 0; i < steps; i++) {
-		motor_set_step(true);
-		delay_us(400);
-		motor_set_step(false);
-		delay_us(400);
-	}
+	struct motor *m = motor_from_arg(num, argc, argv, 1);
+	var_from_str(value, argv[0]);
+
+	if (!m)
+		return -1;
 
-	motor.current = 0;
+	m->is_debug = !!value;
+
+	return 0;
 }
+CONSOLE_CMD(debug_motor, cmd_debug_motor, 1, 2, "если arg1 != 0, то остановить автоматическое управление шаговым двигателем arg2 (по умолчанию первым)... требуется для set_motor");
 
-int cmd_help(uint8_t num, int argc, char *argv[])
+static int cmd_get_motor(uint8_t num, int argc, char *argv[])
 {
-	usart_printf(num, "Доступные команды:\n");
-	for (int i = 0; i < ARRAY_SIZE(cmds); i++) {
-		usart_printf(num, "  - %s", cmds[i].cmd);
-		for (int j = 0; j < cmds[i].arg_min; j++)
-			usart_printf(num, " <arg%d>", j + 1);
-
-		for (int j = cmds[i].arg_min; j < cmds[i].arg_max; j++)
-			usart_printf(num, " [arg%d]", j + 1);
+	struct motor *m = motor_from_arg(num, argc, argv, 0);
 
-		usart_putc(num, '\n');
-		if (cmds[i].help)
-			print_help_text(num, cmds[i].help);
+	if (!m)
+		return -1;
 
-		usart_putc(num, '\n');
-	}
+	usart_printf(num, "%d\n", m->target);
 
 	return 0;
 }
+CONSOLE_CMD(get_motor, cmd_get_motor, 0, 1, "вывести текущую позицию шагового двигателя arg1 (по умолчанию первого)");
 
-int cmd_printenv(uint8_t num, int argc, char *argv[])
+static int cmd_set_motor(uint8_t num, int argc, char *argv[])
 {
-	for (int i = 0; i < ARRAY_SIZE(env); i++) {
-		if (argc && strcmp(argv[0], env[i].name))
-			continue;
+	struct motor *m = motor_from_arg(num, argc, argv, 1);
+	var_from_str(value, argv[0]);
 
-		usart_printf(num, "%s : %d  (%s)\n", env[i].name, env[i].value, env[i].help);
-	}
+	if (!m)
+		return -1;
+
+	m->target = value;
 
 	return 0;
 }
+CONSOLE_CMD(set_motor, cmd_set_motor, 1, 2, "указать текущую позицию шагового двигателя arg2 (смотри debug_motor)");
 
-int cmd_setenv(uint8_t num, int argc, char *argv[])
+// Values are printed from the newest one, ADC_INFO_LINE values per step
+static int adc_info_step(uint8_t num, struct console_job *job)
 {
-	for (int i = 0; i < ARRAY_SIZE(env); i++) {
-		if (!strcmp(env[i].name, argv[0])) {
-			var_from_str(value, argv[1]);
-
-			env[i].value = value;
+	uint32_t start = job->arg;
+	uint32_t count = adc.is_values_wrapped ? ARRAY_SIZE(adc.values) : start;
+	uint32_t tick = HAL_GetTick();
 
-			return 0;
-		}
+	if (!job->pos) {
+		usart_printf(num, "value:      %u\n", adc.value);
+		usart_printf(num, "values_pos: %d\n", adc.values_pos);
+		usart_printf(num, "values:    ");
 	}
 
-	usart_printf(num, "Error: Environment variable '%s' is not found\n", argv[0]);
+	for (int i = 0; i < ADC_INFO_LINE && job->pos < count; i++, job->pos++) {
+		uint32_t pos = (start + ARRAY_SIZE(adc.values) - 1 - job->pos) % ARRAY_SIZE(adc.values);
 
-	return -1;
-}
+		usart_printf(num, " %d", adc.values[pos]);
+	}
 
-int cmd_saveenv(uint8_t num, int argc, char *argv[])
-{
-	if (env_save()) {
-		usart_puts(num, "Error: Failed to save environment\n");
-		return -1;
+	if (job->pos < count) {
+		usart_puts(num, "\n           ");
+		return CONSOLE_JOB_AGAIN;
 	}
 
-	return 0;
+	usart_putc(num, '\n');
+	usart_printf(num, "run_tick:   %u (%u ms ago)\n", adc.run_tick, tick - adc.run_tick);
+	usart_printf(num, "is_debug:   %u\n", (uint8_t)adc.is_debug);
+
+	return CONSOLE_JOB_DONE;
 }
 
-int cmd_loadenv(uint8_t num, int argc, char *argv[])
+static int cmd_adc_info(uint8_t num, int argc, char *argv[])
 {
-	if (env_load()) {
-		usart_puts(num, "Error: Failed to load environment\n");
-		return -1;
-	}
-
-	return 0;
+	return console_job_start(num, adc_info_step, adc.values_pos, NULL);
 }
+CONSOLE_CMD(adc_info, cmd_adc_info, 0, 0, "вывести полную информацию об АЦП");
 
-int cmd_delenv(uint8_t num, int argc, char *argv[])
+// One motor per step, position state after the last one
+static int motor_info_step(uint8_t num, struct console_job *job)
 {
-	if (flash_erase_page(ENV_ADDR)) {
-		usart_puts(num, "Error: Failed to clear environment\n");
-		return -1;
-	}
+	uint32_t tick = HAL_GetTick();
+	struct motor *m;
 
-	return 0;
-}
+	if (job->pos >= ARRAY_SIZE(motors)) {
+		usart_printf(num, "position_saved: %u\n", (uint8_t)position_is_valid());
+		usart_printf(num, "position_lost:  %u\n", (uint8_t)position.is_lost);
+		usart_printf(num, "warm_boots:     %u\n", position.warm_boots);
 
-int cmd_reset(uint8_t num, int argc, char *argv[])
-{
-	uint32_t value;
+		return CONSOLE_JOB_DONE;
+	}
 
-	usart_puts(num, "Resetting...\n");
-	usart_flush(num);
-	value = readl(0xe000ed0c);  // SCB_AIRCR register
-	value = (value & 0xffff) | (0x5fa << 16);  // VECTKEY required to write to this register
-	value |= BIT(2);  // SYSRESETREQ
-	writel(value, 0xe000ed0c);
+	m = &motors[job->pos++];
+	usart_printf(num, "name:           %s\n", m->name);
+	usart_printf(num, "current:        %d\n", m->current);
+	usart_printf(num, "target:         %d\n", m->target);
+	usart_printf(num, "step_tick:      %u (%u ms ago)\n", m->step_tick, tick - m->step_tick);
+	usart_printf(num, "set_dir_tick:   %u (%u ms ago)\n", m->set_dir_tick, tick - m->set_dir_tick);
+	usart_printf(num, "step_is_high:   %u\n", (uint8_t)m->step_is_high);
+	usart_printf(num, "dir_is_forward: %u\n", (uint8_t)m->dir_is_forward);
+	usart_printf(num, "is_debug:       %u\n", (uint8_t)m->is_debug);
+	usart_printf(num, "is_stalled:     %u\n", (uint8_t)m->is_stalled);
+	usart_printf(num, "backlash_left:  %u\n", m->backlash_left);
+	usart_printf(num, "steps_count:    %u\n", m->steps_count);
+	usart_printf(num, "dir_changes:    %u\n", m->dir_changes);
+	usart_printf(num, "park_done:      %u\n\n", m->park_done);
 
-	return 0;
+	return CONSOLE_JOB_AGAIN;
 }
 
-int cmd_get_adc(uint8_t num, int argc, char *argv[])
+static int cmd_motor_info(uint8_t num, int argc, char *argv[])
 {
-	usart_printf(num, "%d\n", adc.value);
-
-	return 0;
+	return console_job_start(num, motor_info_step, 0, NULL);
 }
+CONSOLE_CMD(motor_info, cmd_motor_info, 0, 0, "вывести полную информацию об управлении шаговым двигателем");
 
-int cmd_set_adc(uint8_t num, int argc, char *argv[])
+// Ctrl-C stops only waiting: motor finishes parking and returns to its target by itself
+static int park_step(uint8_t num, struct console_job *job)
 {
-	var_from_str(value, argv[0]);
+	struct motor *m = job->ptr;
 
-	adc.value = value;
-	gpio_pin_set(LED_ALARM, !!(adc.value < env[ENV_ADC_ALERT].value));
+	if (m->is_parking)
+		return CONSOLE_JOB_AGAIN;
 
+	usart_printf(num, "Parked in %u steps\n", m->park_done);
 
-	return 0;
+	return CONSOLE_JOB_DONE;
 }
 
-int cmd_debug_adc(uint8_t num, int argc, char *argv[])
+static int cmd_park(uint8_t num, int argc, char *argv[])
 {
+	struct motor *m = motor_from_arg(num, argc, argv, 1);
 	var_from_str(value, argv[0]);
 
-	adc.is_debug = !!value;
-
-	return 0;
-}
-
-int cmd_debug_motor(uint8_t num, int argc, char *argv[])
-{
-	var_from_str(value, argv[0]);
+	if (!m)
+		return -1;
 
-	motor.is_debug = !!value;
+	motor_park(m, value, !!env_use_stallguard);
 
-	return 0;
+	return console_job_start(num, park_step, 0, m);
 }
+CONSOLE_CMD(park, cmd_park, 1, 2, "парковка шагового двигателя arg2 в крайнее положене (не больше arg1 шагов)");
 
-int cmd_get_motor(uint8_t num, int argc, char *argv[])
-{
-	usart_printf(num, "%d\n", motor.target);
+// Result of asynchronous calculation is kept here: job can be canceled before it is done
+static struct {
+	uint32_t start_tick;
+	uint32_t end_tick;
+	uint32_t crc;
+	int res;
+	volatile bool is_done;
+} crc_cmd;
 
-	return 0;
+// Called from DMA interrupt
+static void crc_cmd_done(uint32_t crc, int res, void *arg)
+{
+	crc_cmd.end_tick = get_tick();
+	crc_cmd.crc = crc;
+	crc_cmd.res = res;
+	crc_cmd.is_done = true;
 }
 
-int cmd_set_motor(uint8_t num, int argc, char *argv[])
+static int crc_step(uint8_t num, struct console_job *job)
 {
-	var_from_str(value, argv[0]);
+	if (!crc_cmd.is_done)
+		return CONSOLE_JOB_AGAIN;
 
-	motor.target = value;
+	if (crc_cmd.res) {
+		usart_puts(num, "Error: DMA transfer failed\n");
+		return -1;
+	}
 
-	return 0;
+	usart_printf(num, "crc:  %#010x\n", crc_cmd.crc);
+	usart_printf(num, "time: %u us\n", tick2us(crc_cmd.end_tick - crc_cmd.start_tick));
+
+	return CONSOLE_JOB_DONE;
 }
 
-int cmd_adc_info(uint8_t num, int argc, char *argv[])
+static int cmd_crc(uint8_t num, int argc, char *argv[])
 {
-	uint32_t tick = HAL_GetTick();
-	uint32_t pos;
-	uint32_t count = 0;
-
-	usart_printf(num, "value:      %u\n", adc.value);
-	usart_printf(num, "values_pos: %d\n", adc.values_pos);
-	usart_printf(num, "values:    ");
-	pos = adc.values_pos;
-	if (pos == 0)
-		pos = ARRAY_SIZE(adc.values) - 1;
-	else
-		pos--;
+	uint32_t addr = (uintptr_t)_vtor;
+	uint32_t len = (uintptr_t)_sidata + ((uintptr_t)_edata - (uintptr_t)_sdata) - addr;
 
-	for (; pos > 0; pos--) {
-		if (count && !(count & 0xf))
-			usart_puts(num, "\n           ");
+	if (argc == 1) {
+		usart_puts(num, "Error: Length is required\n");
+		return -1;
+	}
 
-		count++;
-		usart_printf(num, " %d", adc.values[pos]);
+	if (argc) {
+		var_from_str(value, argv[0]);
+		var_from_str(size, argv[1]);
+		addr = value;
+		len = size;
 	}
 
-	if (adc.is_values_wrapped && adc.values_pos) {
-		pos = ARRAY_SIZE(adc.values) - 1;
-		for (; pos > adc.values_pos; pos--) {
-			if (count && !(count & 0xf))
-				usart_puts(num, "\n           ");
+	if ((addr | len) & 3 || len / 4 > CRC_MAX_WORDS) {
+		usart_printf(num, "Error: Address and length must be aligned to 4, length is up to %u\n",
+			     CRC_MAX_WORDS * 4);
+		return -1;
+	}
 
-			count++;
-			usart_printf(num, " %d", adc.values[pos]);
-		}
+	crc_cmd.is_done = false;
+	crc_cmd.start_tick = get_tick();
+	if (crc_calc_async((void *)(uintptr_t)addr, len / 4, crc_cmd_done, NULL)) {
+		usart_puts(num, "Error: CRC unit is busy\n");
+		return -1;
 	}
 
-	usart_putc(num, '\n');
-	usart_printf(num, "run_tick:   %u (%u ms ago)\n", adc.run_tick, tick - adc.run_tick);
-	usart_printf(num, "is_debug:   %u\n", (uint8_t)adc.is_debug);
+	usart_printf(num, "%#010x - %#010x\n", addr, addr + len);
 
-	return 0;
+	return console_job_start(num, crc_step, 0, NULL);
 }
+CONSOLE_CMD(crc, cmd_crc, 0, 2, "посчитать CRC-32 блоком CRC через DMA для arg2 байт памяти с адреса arg1 (без аргументов - образ программы)");
 
-int cmd_motor_info(uint8_t num, int argc, char *argv[])
+static void monitor_print_uint(char *buf, unsigned int size, void *arg)
 {
-	uint32_t tick = HAL_GetTick();
+	format_snprintf(buf, size, "%u", *(uint32_t *)arg);
+}
 
-	usart_printf(num, "current:        %u\n", motor.current);
-	usart_printf(num, "target:         %u\n", motor.target);
-	usart_printf(num, "step_tick:      %u (%u ms ago)\n", motor.step_tick, tick - motor.step_tick);
-	usart_printf(num, "set_dir_tick:   %u (%u ms ago)\n", motor.set_dir_tick, tick - motor.set_dir_tick);
-	usart_printf(num, "step_is_high:   %u\n", (uint8_t)motor.step_is_high);
-	usart_printf(num, "dir_is_forward: %u\n", (uint8_t)motor.dir_is_forward);
-	usart_printf(num, "is_debug:       %u\n", (uint8_t)motor.is_debug);
+static void monitor_print_int(char *buf, unsigned int size, void *arg)
+{
+	format_snprintf(buf, size, "%d", *(int32_t *)arg);
+}
 
-	return 0;
+static void monitor_print_alert(char *buf, unsigned int size, void *arg)
+{
+	format_snprintf(buf, size, "%s", adc.value < env_adc_alert ? "ON" : "off");
 }
 
-int cmd_park(uint8_t num, int argc, char *argv[])
+static void monitor_print_motor_state(char *buf, unsigned int size, void *arg)
 {
-	var_from_str(value, argv[0]);
+	struct motor *m = arg;
 
-	motor_park(value);
+	if (m->is_parking)
+		format_snprintf(buf, size, "parking");
+	else if (m->current != m->target)
+		format_snprintf(buf, size, "moving %s", m->dir_is_forward ? "up" : "down");
+	else
+		format_snprintf(buf, size, "rest");
 
-	return 0;
+	if (m->is_stalled)
+		strncat(buf, " stall", size - strlen(buf) - 1);
 }
 
-void console_parse(uint8_t num)
+static void monitor_print_uptime(char *buf, unsigned int size, void *arg)
 {
-	char *args[5];
-	int argc = 0;
-	int size = strlen(console.line);
-	int pos = console.history_pos ? console.history_pos - 1 : ARRAY_SIZE(console.history) - 1;
-	bool last_space = false;
-
-	if (!size)
-		return;
-
-	if (strcmp(console.history[pos], console.line)) {
-		strncpy(console.history[console.history_pos++], console.line, sizeof(console.history[0]));
-		if (console.history_pos >= ARRAY_SIZE(console.history))
-			console.history_pos = 0;
+	uint32_t sec = HAL_GetTick() / 1000;
 
-		if (console.history_size < ARRAY_SIZE(console.history))
-			console.history_size++;
-	}
+	format_snprintf(buf, size, "%u:%02u:%02u", sec / 3600, (sec / 60) % 60, sec % 60);
+}
 
-	for (int i = 0; i < size; i++) {
-		if (console.line[i] == ' ') {
-			console.line[i] = '\0';
-			last_space = true;
-		} else {
-			if (last_space) {
-				if (argc >= ARRAY_SIZE(args)) {
-					usart_puts(num, "Error: Too many arguments\n");
-					return;
-				}
-				args[argc++] = &console.line[i];
-				last_space = false;
-			}
-		}
+static int cmd_monitor(uint8_t num, int argc, char *argv[])
+{
+	if (monitor_is_active(0)) {
+		usart_puts(num, "Error: Monitor is already running on another console\n");
+		return -1;
 	}
 
-	for (int i = 0; i < ARRAY_SIZE(cmds); i++) {
-		if (!strcmp(console.line, cmds[i].cmd)) {
-			if (argc < cmds[i].arg_min || argc > cmds[i].arg_max) {
-				usart_printf(num,
-					     "Error: Incorrect arguments count. Expected [%d..%d], but sended %d\n",
-					     cmds[i].arg_min,
-					     cmds[i].arg_max,
-					     argc);
-				return;
-			}
+	monitor_start(num, "Fuel indicator monitor", monitor_fields, ARRAY_SIZE(monitor_fields));
 
-			cmds[i].func(num, argc, args);
-			return;
-		}
-	}
-
-	usart_printf(num, "Error: Unknown command '%s'\n", console.line);
+	return 0;
 }
+CONSOLE_CMD(monitor, cmd_monitor, 0, 0, "показать на весь экран терминала значения АЦП, позиции стрелок и время главного цикла с обновлением 10 раз в секунду... любая клавиша - выход");
 
-static void console_move_cursor(uint8_t num, int shift, bool to_left)
+static uint8_t proto_adc(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
 {
-	char buf[6] = "\x1b[0\0\0\0";
-	char dir = to_left ? 'D' : 'C';
+	struct proto_adc rec = { 0 };
+	int pos = adc.values_pos ? adc.values_pos - 1 : ARRAY_SIZE(adc.values) - 1;
 
-	if (!shift)
-		return;
-	else if (shift > 99)
-		shift = 99;
+	rec.value = adc.value;
+	rec.run_tick = adc.run_tick;
+	rec.last = adc.values[pos];
+	rec.values_pos = adc.values_pos;
+	if (adc.is_debug)
+		rec.flags |= PROTO_ADC_DEBUG;
+	if (adc.is_values_wrapped)
+		rec.flags |= PROTO_ADC_WRAPPED;
 
-	if (shift < 10) {
-		buf[2] = shift + '0';
-		buf[3] = dir;
-	} else {
-		buf[2] = shift / 10 + '0';
-		buf[3] = shift % 10 + '0';
-		buf[4] = dir;
-	}
+	memcpy(resp, &rec, sizeof(rec));
+	*resp_len = sizeof(rec);
 
-	usart_puts(num, buf);
+	return PROTO_OK;
 }
 
-static void console_print_history(uint8_t num)
+static uint8_t proto_motor(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
 {
-	int len;
-	int pos;
+	struct proto_motor rec = { 0 };
+	struct motor *m;
 
-	if (console.history_sel) {
-		pos = console.history_sel;
-		if (pos > console.history_pos)
-			pos = ARRAY_SIZE(console.history) - (pos - console.history_pos);
-		else
-			pos = console.history_pos - pos;
+	if (req[0] >= ARRAY_SIZE(motors))
+		return PROTO_ERR_ARG;
 
-		strncpy(console.line, console.history[pos], sizeof(console.line));
-	} else {
-		console.line[0] = '\0';
-	}
+	m = &motors[req[0]];
+	rec.index = req[0];
+	rec.backlash_left = m->backlash_left;
+	rec.current = m->current;
+	rec.target = m->target;
+	rec.steps_count = m->steps_count;
+	rec.dir_changes = m->dir_changes;
+	rec.park_done = m->park_done;
+	rec.step_tick = m->step_tick;
+	strncpy(rec.name, m->name, sizeof(rec.name));
+	if (m->dir_is_forward)
+		rec.flags |= PROTO_MOTOR_FORWARD;
+	if (m->is_parking)
+		rec.flags |= PROTO_MOTOR_PARKING;
+	if (m->is_stalled)
+		rec.flags |= PROTO_MOTOR_STALLED;
+	if (m->is_debug)
+		rec.flags |= PROTO_MOTOR_DEBUG;
 
-	len = strlen(console.line);
-	console_move_cursor(num, console.line_pos, true);
-	usart_puts(num, console.line);
-	if (len < console.line_pos) {
-		for (int i = 0; i < console.line_size - len; i++)
-			usart_putc(num, ' ');
+	memcpy(resp, &rec, sizeof(rec));
+	*resp_len = sizeof(rec);
 
-		console_move_cursor(num, console.line_size - len, true);
-	}
-	console.line_size = len;
-	console.line_pos = len;
-}
-
-static void console_process(uint8_t num)
-{
-	while (usart_is_received(num)) {
-		uint8_t ch = usart_recv_byte(num);
-
-		if (console.is_esc_seq) {
-			console.esc_seq = (console.esc_seq << 8) | ch;
-			if ((console.esc_seq_pos && ch >= 0x41) || console.esc_seq_pos > 4 || ch <= 0x20) {
-				console.is_esc_seq = false;
-				switch (console.esc_seq) {
-				case ESC_RIGHT:
-					if (console.line_pos < console.line_size) {
-						console_move_cursor(num, 1, false);
-						console.line_pos++;
-					}
-					break;
-				case ESC_LEFT:
-					if (console.line_pos) {
-						console_move_cursor(num, 1, true);
-						console.line_pos--;
-					}
-					break;
-				case ESC_HOME:
-				case ESC_HOME2:
-					if (console.line_pos) {
-						console_move_cursor(num, console.line_pos, true);
-						console.line_pos = 0;
-					}
-					break;
-				case ESC_END:
-				case ESC_END2:
-					if (console.line_pos < console.line_size) {
-						console_move_cursor(num, console.line_size - console.line_pos, false);
-						console.line_pos = console.line_size;
-					}
-					break;
-				case ESC_UP:
-					if (console.history_sel < console.history_size) {
-						console.history_sel++;
-						console_print_history(num);
-					}
-					break;
-				case ESC_DOWN:
-					if (console.history_sel > 0) {
-						console.history_sel--;
-						console_print_history(num);
-					}
-					break;
-				default:
-					// usart_printf(num, " escseq: %#x\n", console.esc_seq);
-					break;
-				}
-			} else {
-				console.esc_seq_pos++;
-			}
-
-			continue;
-		}
-
-		switch (ch) {
-		case 0x1b:  // Esc
-			console.is_esc_seq = true;
-			console.esc_seq = 0;
-			console.esc_seq_pos = 0;
-			break;
-		case 0x8:  // Backspace
-		case 0x7f:  // Backspace
-			if (console.line_pos) {
-				for (int i = console.line_pos; i < console.line_size + 1; i++)
-					console.line[i - 1] = console.line[i];
-
-				console.line_pos--;
-				console.line_size--;
-				console.line[console.line_size] = '\0';
-				console_move_cursor(num, 1, true);
-				usart_printf(num, "%s ", &console.line[console.line_pos]);
-				console_move_cursor(num, console.line_size - console.line_pos + 1, true);
-			}
-			break;
-		case 0xd:
-			usart_printf(num, "\n");
-			console_parse(num);
-			usart_printf(num, "\n[console]# ");
-			console.line_pos = 0;
-			console.line_size = 0;
-			console.line[0] = '\0';
-			console.history_sel = 0;
-		case 0xa:
-			break;
-		default:
-			if (console.line_size < (sizeof(console.line) - 2)) {
-				for (int i = console.line_size; i >= console.line_pos; i--)
-					console.line[i + 1] = console.line[i];
-
-				console.line[console.line_pos] = ch;
-				usart_puts(num, &console.line[console.line_pos]);
-				console_move_cursor(num, console.line_size - console.line_pos, true);
-				console.line_size++;
-				console.line_pos++;
-			}
-			break;
-		}
-	}
+	return PROTO_OK;
 }
 
 void adc_process(void)
@@ -802,6 +687,7 @@ void adc_process(void)
 	uint32_t tick = HAL_GetTick();
 	int32_t svalue;
 	uint32_t value;
+	uint16_t raw;
 
 	if (!adc.is_run && !adc.is_debug && (tick - adc.run_tick) > ADC_RUN_PERIOD) {
 		adc_run_single(1, 4);
@@ -825,7 +711,9 @@ void adc_process(void)
 			adc.is_run = false;
 			adc.is_started = false;
 			if (svalue != -1) {
-				if (env[ENV_USE_EMA_FILTER].value) {
+				raw = svalue;
+				adc.raw = raw;
+				if (env_use_ema_filter) {
 					uint32_t n = ARRAY_SIZE(adc.values);
 					uint32_t prev_idx = (adc.values_pos == 0) ?
 							    (ARRAY_SIZE(adc.values) - 1) :
@@ -854,7 +742,9 @@ void adc_process(void)
 				}
 
 				adc.value = value / (adc.is_values_wrapped ? ARRAY_SIZE(adc.values) : adc.values_pos);
-				gpio_pin_set(LED_ALARM, !!(adc.value < env[ENV_ADC_ALERT].value));
+				gpio_pin_set(LED_ALARM, !!(adc.value < env_adc_alert));
+				telemetry_adc(raw, adc.value, adc.value < env_adc_alert);
+				logger_adc(raw, adc.value, adc.value < env_adc_alert ? LOGGER_ALERT : 0);
 			} else {
 				// Error: ADC is not ready... impossible here
 				// TODO: Stop ADC
@@ -864,47 +754,81 @@ void adc_process(void)
 	}
 }
 
-static void calc_target(void)
+static bool fuel_get_target(struct motor *m, int32_t *target)
 {
 	int32_t adc_value = adc.value;
-	int32_t adc_range = env[ENV_ADC_FULL].value - env[ENV_ADC_EMPTY].value;
-	int32_t step_range = env[ENV_STEPS_FULL].value - env[ENV_STEPS_EMPTY].value;
-	int32_t adc_full_plus = env[ENV_ADC_FULL].value + (env[ENV_ADC_FULL].value / 10);
+	int32_t adc_range = env_adc_full - env_adc_empty;
+	int32_t step_range = env_steps_full - env_steps_empty;
+	int32_t adc_full_plus = env_adc_full + (env_adc_full / 10);
 
-	if (adc_value < env[ENV_ADC_OVEREMPTY].value)
-		adc_value = env[ENV_ADC_OVEREMPTY].value;
+	if (!adc.is_values_wrapped && adc.values_pos <= 30)
+		return false;  // not enough values for filtering yet
+
+	if (adc_value < env_adc_overempty)
+		adc_value = env_adc_overempty;
 	else if (adc.value > adc_full_plus)
 		adc_value = adc_full_plus;
 
-	motor.target = ((adc_value - (int32_t)env[ENV_ADC_EMPTY].value) * step_range) / adc_range + (int32_t)env[ENV_STEPS_EMPTY].value;
-}
+	*target = ((adc_value - (int32_t)env_adc_empty) * step_range) / adc_range + (int32_t)env_steps_empty;
 
-#define MOTOR_HALF_PERIOD 2
-#define MOTOR_DIR_TO_STEP_TIME 2
+	return true;
+}
 
-void motor_process(void)
+// Position is saved when needles are at rest and invalidated as soon as they start moving
+static void position_process(bool is_ignition_off)
 {
 	uint32_t tick = HAL_GetTick();
+	bool is_rest = true;
+
+	// Keep position saved on power loss
+	if (position.is_power_low)
+		return;
 
-	if (!motor.is_debug) {
-		if (adc.is_values_wrapped || adc.values_pos > 30)
-		calc_target();
+	for (int i = 0; i < ARRAY_SIZE(motors); i++) {
+		struct motor *m = &motors[i];
+
+		if (m->is_parking || m->current != m->target)
+			is_rest = false;
+		else if (m->is_stalled && env_use_stallguard)
+			position.is_lost = true;  // stall while moving: steps were lost, home on next boot
 	}
 
-	if (motor.step_is_high && (tick - motor.step_tick) >= MOTOR_HALF_PERIOD)
-		motor_set_step(false);
+	if (!is_rest) {
+		position_invalidate();
+		position.rest_tick = tick;
+		return;
+	}
 
-	if (motor.current == motor.target)
+	if (position_is_valid() || position.is_lost)
 		return;
 
-	if (tick - motor.step_tick >= MOTOR_HALF_PERIOD) {
-		bool is_forward = (motor.target > motor.current);
-		if (is_forward != motor.dir_is_forward)
-			motor_set_dir(is_forward);
+	if (!is_ignition_off) {
+		if (tick - position.rest_tick < POSITION_SAVE_DELAY ||
+		    tick - position.save_tick < POSITION_SAVE_PERIOD)
+			return;
+	}
 
-		if (tick - motor.set_dir_tick >= MOTOR_DIR_TO_STEP_TIME) {
-			motor_set_step(true);
-		}
+	position_save(motors, ARRAY_SIZE(motors), position.warm_boots);
+	position.save_tick = tick;
+}
+
+static void loop_stats_update(void)
+{
+	uint32_t tick = get_tick();
+	uint32_t us = tick2us(tick - loop.tick);
+
+	loop.tick = tick;
+	loop.count++;
+	if (us > loop.max_us)
+		loop.max_us = us;
+
+	telemetry_loop(us);
+	if (HAL_GetTick() - loop.window_tick >= LOOP_STATS_PERIOD) {
+		loop.window_tick = HAL_GetTick();
+		loop.rate = loop.count;
+		loop.window_max_us = loop.max_us;
+		loop.count = 0;
+		loop.max_us = 0;
 	}
 }
 
@@ -913,14 +837,24 @@ int main(void)
 	SystemClock_Config();
 	SystemCoreClockUpdate();
 	HAL_Init();
+	memcpy(ram_vectors, _vtor, sizeof(ram_vectors));
+	nvic_set_vectors(ram_vectors);
 
 	rcc_clk_enable(RCC_CLK_GPIOA);
 	rcc_clk_enable(RCC_CLK_GPIOB);
 	rcc_clk_enable(RCC_CLK_GPIOC);
+	rcc_clk_enable(RCC_CLK_AFIO);
 	rcc_clk_enable(RCC_CLK_ADC1);
 	rcc_clk_enable(RCC_CLK_USART1);
+	rcc_clk_enable(RCC_CLK_USART2);
+	rcc_clk_enable(RCC_CLK_TIM2);
+	rcc_clk_enable(RCC_CLK_PWR);
+	rcc_clk_enable(RCC_CLK_DMA1);
+	rcc_clk_enable(RCC_CLK_CRC);
 
 	delay_init();
+	nvic_set_priority(IRQ_DMA1_CH1 + CRC_DMA_CH - 1, 2);
+	crc_init();
 
 	gpio_init(USART1_TX, GPIO_DIR_OUT, GPIO_DRV_PP, GPIO_SPEED_MEDIUM, GPIO_FLAG_ALTERNATE);
 	gpio_init(USART1_RX, GPIO_DIR_IN, GPIO_DRV_PP, GPIO_SPEED_MEDIUM, GPIO_FLAG_ALTERNATE);
@@ -928,13 +862,30 @@ int main(void)
 	gpio_pin_set(GPIO_LED_SMALL, 1);
 	gpio_init(GPIO_LED_SMALL, GPIO_DIR_OUT, GPIO_DRV_OD, GPIO_SPEED_LOW, 0);
 
-	gpio_init(GPIO_STEP, GPIO_DIR_OUT, GPIO_DRV_PP, GPIO_SPEED_LOW, 0);
-	gpio_init(GPIO_DIR, GPIO_DIR_OUT, GPIO_DRV_PP, GPIO_SPEED_LOW, 0);
+	motor_init(motors, ARRAY_SIZE(motors));
+	nvic_set_priority(IRQ_EXTI15_10, 1);
+	nvic_enable_irq(IRQ_EXTI15_10);
+	timer_init(MOTOR_TIMER_NUM, 72000000, MOTOR_TICK_FREQ);
+	nvic_set_priority(IRQ_TIM2, 1);
+	nvic_enable_irq(IRQ_TIM2);
+	timer_start(MOTOR_TIMER_NUM);
 
 	gpio_init(LED_ALARM, GPIO_DIR_OUT, GPIO_DRV_PP, GPIO_SPEED_LOW, 0);
 	gpio_pin_set(LED_ALARM, 1);
 
-	usart_init(UART_NUM, 72000000, 115200);
+	usart_init(UART_NUM, UART_PCLK, CONSOLE_BAUDRATE);
+	nvic_set_priority(IRQ_USART1, 1);
+	usart_rx_irq_enable(UART_NUM);
+	nvic_set_priority(IRQ_DMA1_CH4, 2);
+	usart_tx_dma_enable(UART_NUM, USART_TX_BLOCK);
+
+	gpio_init(USART2_TX, GPIO_DIR_OUT, GPIO_DRV_PP, GPIO_SPEED_MEDIUM, GPIO_FLAG_ALTERNATE);
+	gpio_init(USART2_RX, GPIO_DIR_IN, GPIO_DRV_PP, GPIO_SPEED_MEDIUM, GPIO_FLAG_ALTERNATE);
+	usart_init(UART2_NUM, UART2_PCLK, CONSOLE_BAUDRATE);
+	nvic_set_priority(IRQ_USART2, 1);
+	usart_rx_irq_enable(UART2_NUM);
+	nvic_set_priority(IRQ_DMA1_CH7, 2);
+	usart_tx_dma_enable(UART2_NUM, USART_TX_BLOCK);
 
 	gpio_init(GEN_GPIO(BANK_GPIOA, 4), GPIO_DIR_IN, GPIO_DRV_PP, GPIO_SPEED_MEDIUM, 0); // ADC12_IN4 - from fuel resistor
 	gpio_init(GPIO_ENABLE, GPIO_DIR_IN, GPIO_DRV_PP, GPIO_SPEED_MEDIUM, 0); // ADC12_IN6 - ENABLE signal
@@ -948,21 +899,67 @@ int main(void)
 
 	HAL_Delay(200);
 
+	console_init(consoles, ARRAY_SIZE(consoles), proto_handlers, ARRAY_SIZE(proto_handlers));
 	usart_printf(UART_NUM, "Environment load %s\n", env_load() ? "failed" : "done");
-	cmd_printenv(UART_NUM, 0, NULL);
+	console_apply_env();
 
-	usart_puts(UART_NUM, "Parking...\n");
-	motor_park(env[ENV_STEPS_TOTAL].value);
+	telemetry_init(motors, ARRAY_SIZE(motors));
+	logger_init();
+	integrity_init();
+	env_print(UART_NUM, NULL);
 
-	usart_puts(UART_NUM, "\n[console]# ");
+	if (!position_load(motors, ARRAY_SIZE(motors), &position.warm_boots) &&
+	    position.warm_boots < env_home_period) {
+		position.warm_boots++;
+		usart_printf(UART_NUM, "Position restored (%u boots without parking)\n", position.warm_boots);
+	} else {
+		usart_puts(UART_NUM, "Parking...\n");
+		motors_park(UART_NUM, true);
+		position.warm_boots = 0;
+	}
 
+	// Background flash jobs must not delay stepping
+	nvic_set_priority(IRQ_FLASH, 2);
+	flash_irq_enable();
+
+	position_save(motors, ARRAY_SIZE(motors), position.warm_boots);
+	position.save_tick = HAL_GetTick();
+
+	// PVD has the highest priority to save position before power is lost
+	pwr_pvd_init(PWR_PVD_2_9V);
+	exti_init(EXTI_LINE_PVD, EXTI_TRIGGER_RISING | EXTI_TRIGGER_FALLING);
+	exti_enable(EXTI_LINE_PVD, true);
+	nvic_set_priority(IRQ_PVD, 0);
+	nvic_enable_irq(IRQ_PVD);
+
+	for (int i = 0; i < ARRAY_SIZE(consoles); i++)
+		usart_puts(consoles[i].num, "\n[console]# ");
+
+	loop.tick = get_tick();
+	loop.window_tick = HAL_GetTick();
 	while (1) {
-		console_process(UART_NUM);
+		loop_stats_update();
+		console_process();
+		telemetry_process();
+		bulk_process();
+		monitor_process();
+		logger_process(!gpio_pin_get(GPIO_ENABLE));
+		if (integrity_process()) {
+			// Fault is latched until reset, small LED shows it
+			gpio_pin_set(GPIO_LED_SMALL, 0);
+			for (int i = 0; i < ARRAY_SIZE(consoles); i++)
+				usart_puts(consoles[i].num, "\nError: CRC of program in flash is wrong (see integrity_info)\n");
+		}
 		if (!gpio_pin_get(GPIO_ENABLE)) {
-			motor_park(motor.current);
+			for (int i = 0; i < ARRAY_SIZE(motors); i++) {
+				if (!motors[i].is_parking && motors[i].current)
+					motor_park(&motors[i], motors[i].current, !!env_use_stallguard);
+			}
+			position_process(true);
 		} else {
 			adc_process();
 			motor_process();
+			position_process(false);
 		}
 	}
 }
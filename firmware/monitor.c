@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "common.h"
+#include "format.h"
+#include "monitor.h"
+#include "usart.h"
+
+struct monitor {
+	const struct monitor_field *fields;
+	unsigned int count;
+	uint32_t refresh_tick;
+	char values[MONITOR_MAX_FIELDS][MONITOR_MAX_WIDTH + 1];  // what is on the screen now
+	uint8_t num;
+	uint8_t last_row;
+	bool is_active;
+};
+
+static struct monitor monitor;
+
+void monitor_start(uint8_t num, char *title, const struct monitor_field *fields, unsigned int count)
+{
+	if (count > MONITOR_MAX_FIELDS)
+		count = MONITOR_MAX_FIELDS;
+
+	monitor.num = num;
+	monitor.fields = fields;
+	monitor.count = count;
+	monitor.last_row = 1;
+	// Clear screen, hide cursor
+	usart_printf(num, "\x1b[2J\x1b[?25l\x1b[1;1H%s", title);
+	for (unsigned int i = 0; i < count; i++) {
+		const struct monitor_field *f = &fields[i];
+
+		usart_printf(num, "\x1b[%u;%uH%s", f->row, f->col, f->label);
+		// Impossible text: every value is drawn on first refresh
+		monitor.values[i][0] = '\x1b';
+		monitor.values[i][1] = '\0';
+		if (f->row > monitor.last_row)
+			monitor.last_row = f->row;
+	}
+
+	usart_printf(num, "\x1b[%u;1HPress any key to exit", monitor.last_row + 2);
+	monitor.refresh_tick = HAL_GetTick() - MONITOR_PERIOD;
+	monitor.is_active = true;
+}
+
+void monitor_stop(void)
+{
+	if (!monitor.is_active)
+		return;
+
+	monitor.is_active = false;
+	// Show cursor under dashboard
+	usart_printf(monitor.num, "\x1b[%u;1H\x1b[?25h\n", monitor.last_row + 3);
+}
+
+bool monitor_is_active(uint8_t num)
+{
+	return monitor.is_active && (!num || monitor.num == num);
+}
+
+void monitor_process(void)
+{
+	uint32_t tick = HAL_GetTick();
+	char buf[MONITOR_MAX_WIDTH + 1];
+
+	if (!monitor.is_active || tick - monitor.refresh_tick < MONITOR_PERIOD)
+		return;
+
+	monitor.refresh_tick = tick;
+	for (unsigned int i = 0; i < monitor.count; i++) {
+		const struct monitor_field *f = &monitor.fields[i];
+		unsigned int width = f->width;
+
+		if (width > MONITOR_MAX_WIDTH)
+			width = MONITOR_MAX_WIDTH;
+
+		f->print(buf, width + 1, f->arg);
+		if (!strcmp(buf, monitor.values[i]))
+			continue;
+
+		// Value is padded by spaces to erase longer previous value
+		usart_printf(monitor.num, "\x1b[%u;%uH%-*s", f->row, f->col + strlen(f->label), width, buf);
+		strcpy(monitor.values[i], buf);
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef _MONITOR_H
+#define _MONITOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MONITOR_PERIOD		100  // ms between refreshes
+#define MONITOR_MAX_FIELDS	16
+#define MONITOR_MAX_WIDTH	16
+
+// Field of dashboard: label is drawn once, value is redrawn only when its text is changed
+struct monitor_field {
+	uint8_t row;  // starting from 1 as in VT100
+	uint8_t col;
+	uint8_t width;  // of value (up to MONITOR_MAX_WIDTH)
+	char *label;
+	// Prints value into buf (null-terminated)
+	void (*print)(char *buf, unsigned int size, void *arg);
+	void *arg;
+};
+
+// Clears screen and draws labels. Any received byte must stop monitor (see monitor_stop)
+void monitor_start(uint8_t num, char *title, const struct monitor_field *fields, unsigned int count);
+void monitor_stop(void);
+// num 0 - on any USART
+bool monitor_is_active(uint8_t num);
+// Called from main loop: redraws changed values every MONITOR_PERIOD
+void monitor_process(void);
+
+#endif  // _MONITOR_H
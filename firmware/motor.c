@@ -0,0 +1,204 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "common.h"
+#include "exti.h"
+#include "gpio.h"
+#include "motor.h"
+
+static struct motor *motors;
+static unsigned int motors_count;
+
+void motor_init(struct motor *m, unsigned int count)
+{
+	motors = m;
+	motors_count = count;
+
+	for (unsigned int i = 0; i < count; i++) {
+		gpio_init(m[i].gpio_step, GPIO_DIR_OUT, GPIO_DRV_PP, GPIO_SPEED_LOW, 0);
+		gpio_init(m[i].gpio_dir, GPIO_DIR_OUT, GPIO_DRV_PP, GPIO_SPEED_LOW, 0);
+		if (m[i].gpio_diag != GPIO_NONE) {
+			gpio_init(m[i].gpio_diag, GPIO_DIR_IN, GPIO_DRV_PP, GPIO_SPEED_LOW, GPIO_FLAG_PD);
+			exti_gpio_init(m[i].gpio_diag, EXTI_TRIGGER_RISING);
+			exti_enable(GPIO_TO_PIN(m[i].gpio_diag), true);
+		}
+	}
+}
+
+struct motor *motor_find(char *name)
+{
+	for (unsigned int i = 0; i < motors_count; i++) {
+		if (!strcmp(motors[i].name, name))
+			return &motors[i];
+	}
+
+	return NULL;
+}
+
+static RAMFUNC void motor_set_dir(struct motor *m, bool is_forward)
+{
+	uint32_t backlash = m->backlash ? *m->backlash : 0;
+
+	m->dir_is_forward = is_forward;
+	m->set_dir_tick = HAL_GetTick();
+	m->dir_wait = MOTOR_DIR_TO_STEP_TIME * MOTOR_TICK_FREQ / 1000;
+	m->dir_changes++;
+	gpio_pin_set(m->gpio_dir, (uint32_t)is_forward);
+
+	// Gear play taken up in previous direction must be passed again (not needed for parking)
+	if (m->is_parking || m->backlash_left > backlash)
+		m->backlash_left = 0;
+	else
+		m->backlash_left = backlash - m->backlash_left;
+}
+
+static RAMFUNC void motor_set_step(struct motor *m, bool high)
+{
+	m->step_is_high = high;
+	gpio_pin_set(m->gpio_step, (uint32_t)high);
+	if (!high)
+		return;
+
+	m->step_tick = HAL_GetTick();
+	m->steps_count++;
+	// Backlash compensation steps do not move needle
+	if (m->backlash_left)
+		m->backlash_left--;
+	else
+		m->current += m->dir_is_forward ? 1 : -1;
+}
+
+static RAMFUNC void motor_tick_one(struct motor *m)
+{
+	uint32_t speed;
+	bool is_forward;
+
+	// Step pulse is one tick long, it is counted by accumulator as any other tick of step period
+	if (m->step_is_high) {
+		motor_set_step(m, false);
+		m->accum += m->is_parking ? MOTOR_PARK_SPEED : MOTOR_SPEED;
+		return;
+	}
+
+	if (m->is_parking) {
+		if (m->park_done < MOTOR_STALL_BLANK_STEPS)
+			m->is_stalled = false;  // StallGuard result is not valid right after start
+
+		if (m->park_done >= m->park_steps || (m->park_use_stallguard && m->is_stalled)) {
+			m->current = 0;
+			m->target = 0;
+			m->accum = 0;
+			m->is_stalled = false;
+			m->is_parking = false;
+			return;
+		}
+
+		is_forward = false;
+		speed = MOTOR_PARK_SPEED;
+	} else {
+		if (m->current == m->target) {
+			if (!m->backlash_left) {
+				m->accum = 0;
+				return;
+			}
+
+			is_forward = m->dir_is_forward;
+		} else {
+			is_forward = m->target > m->current;
+		}
+
+		speed = MOTOR_SPEED;
+	}
+
+	if (is_forward != m->dir_is_forward) {
+		motor_set_dir(m, is_forward);
+		return;
+	}
+
+	if (m->dir_wait) {
+		m->dir_wait--;
+		return;
+	}
+
+	// Bresenham-like accumulator: steps are evenly spread over ticks with given speed
+	m->accum += speed;
+	if (m->accum < MOTOR_TICK_FREQ)
+		return;
+
+	m->accum -= MOTOR_TICK_FREQ;
+	motor_set_step(m, true);
+	if (m->is_parking)
+		m->park_done++;
+}
+
+RAMFUNC void motor_tick(void)
+{
+	for (unsigned int i = 0; i < motors_count; i++)
+		motor_tick_one(&motors[i]);
+}
+
+RAMFUNC void motor_stall_irq(void)
+{
+	for (unsigned int i = 0; i < motors_count; i++) {
+		uint8_t line;
+
+		if (motors[i].gpio_diag == GPIO_NONE)
+			continue;
+
+		line = GPIO_TO_PIN(motors[i].gpio_diag);
+		if (exti_is_pending(line)) {
+			exti_clear_pending(line);
+			motors[i].is_stalled = true;
+		}
+	}
+}
+
+// Small target change back against the last direction is ignored to avoid needle jitter
+static int32_t motor_apply_hysteresis(struct motor *m, int32_t target)
+{
+	int32_t hysteresis = m->hysteresis ? *m->hysteresis : 0;
+	int32_t current = m->current;
+	int32_t diff = target - current;
+
+	if (m->dir_is_forward && diff < 0 && diff >= -hysteresis)
+		return current;
+
+	if (!m->dir_is_forward && diff > 0 && diff <= hysteresis)
+		return current;
+
+	return target;
+}
+
+void motor_process(void)
+{
+	for (unsigned int i = 0; i < motors_count; i++) {
+		struct motor *m = &motors[i];
+		int32_t target;
+
+		if (m->is_debug || m->is_parking || !m->get_target)
+			continue;
+
+		if (m->get_target(m, &target))
+			m->target = motor_apply_hysteresis(m, target);
+	}
+}
+
+void motor_park(struct motor *m, uint32_t steps, bool use_stallguard)
+{
+	m->park_steps = steps;
+	m->park_done = 0;
+	m->park_use_stallguard = use_stallguard && m->gpio_diag != GPIO_NONE;
+	m->is_parking = true;
+}
+
+bool motor_is_parking(void)
+{
+	for (unsigned int i = 0; i < motors_count; i++) {
+		if (motors[i].is_parking)
+			return true;
+	}
+
+	return false;
+}
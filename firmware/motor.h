@@ -0,0 +1,63 @@
+#ifndef _MOTOR_H
+#define _MOTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gpio.h"
+
+// Frequency of timer tick which services all motors
+#define MOTOR_TICK_FREQ		10000
+
+#define MOTOR_SPEED		250  // steps per second
+#define MOTOR_PARK_SPEED	1250  // steps per second
+#define MOTOR_DIR_TO_STEP_TIME	2  // ms
+
+// Steps after start of parking while DIAG signal is ignored
+#define MOTOR_STALL_BLANK_STEPS	8
+
+struct motor {
+	char *name;
+	gpio_t gpio_step;
+	gpio_t gpio_dir;
+	gpio_t gpio_diag;  // GPIO_NONE if StallGuard is not connected
+	uint32_t *steps_total;  // steps to the end stop (calibration)
+	uint32_t *backlash;  // extra steps after direction change to take up gear play
+	uint32_t *hysteresis;  // target changes against last direction less than this are ignored
+	// Target source: returns false if target is not known yet
+	bool (*get_target)(struct motor *m, int32_t *target);
+
+	// Fields below are changed from timer tick
+	volatile int32_t current;
+	volatile int32_t target;
+	volatile uint32_t accum;
+	volatile uint32_t dir_wait;
+	volatile uint32_t park_steps;
+	volatile uint32_t park_done;
+	volatile uint32_t backlash_left;
+	volatile uint32_t steps_count;
+	volatile uint32_t dir_changes;
+	volatile uint32_t step_tick;
+	volatile uint32_t set_dir_tick;
+	volatile bool step_is_high;
+	volatile bool dir_is_forward;
+	volatile bool is_parking;
+	volatile bool park_use_stallguard;
+	volatile bool is_stalled;
+	bool is_debug;
+};
+
+void motor_init(struct motor *motors, unsigned int count);
+struct motor *motor_find(char *name);
+
+// Called from timer interrupt with MOTOR_TICK_FREQ frequency
+void motor_tick(void);
+// Called from EXTI interrupt of DIAG lines
+void motor_stall_irq(void);
+// Called from main loop: update targets from their sources
+void motor_process(void);
+
+void motor_park(struct motor *m, uint32_t steps, bool use_stallguard);
+bool motor_is_parking(void);
+
+#endif  // _MOTOR_H
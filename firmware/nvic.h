@@ -0,0 +1,69 @@
+#ifndef _NVIC_H
+#define _NVIC_H
+
+#include <stdint.h>
+
+#include <common.h>
+
+#define NVIC_ISER_ADDR	0xe000e100
+#define NVIC_ICER_ADDR	0xe000e180
+#define NVIC_ICPR_ADDR	0xe000e280
+#define NVIC_IPR_ADDR	0xe000e400
+#define SCB_VTOR_ADDR	0xe000ed08
+
+#ifdef STM32F1
+#define IRQ_PVD		1
+#define IRQ_FLASH	4
+#define IRQ_EXTI0	6
+#define IRQ_EXTI1	7
+#define IRQ_EXTI2	8
+#define IRQ_EXTI3	9
+#define IRQ_EXTI4	10
+#define IRQ_DMA1_CH1	11
+#define IRQ_DMA1_CH2	12
+#define IRQ_DMA1_CH3	13
+#define IRQ_DMA1_CH4	14
+#define IRQ_DMA1_CH5	15
+#define IRQ_DMA1_CH6	16
+#define IRQ_DMA1_CH7	17
+#define IRQ_EXTI9_5	23
+#define IRQ_TIM2	28
+#define IRQ_TIM3	29
+#define IRQ_TIM4	30
+#define IRQ_USART1	37
+#define IRQ_USART2	38
+#define IRQ_USART3	39
+#define IRQ_EXTI15_10	40
+
+#define NVIC_PRIO_BITS	4
+#define NVIC_VECTORS	(16 + 43)  // system exceptions and interrupts of STM32F103xB
+#endif
+
+inline static void nvic_enable_irq(uint32_t irq)
+{
+	writel(BIT(irq & 0x1f), NVIC_ISER_ADDR + (irq >> 5) * 4);
+}
+
+inline static void nvic_disable_irq(uint32_t irq)
+{
+	writel(BIT(irq & 0x1f), NVIC_ICER_ADDR + (irq >> 5) * 4);
+}
+
+inline static void nvic_clear_pending(uint32_t irq)
+{
+	writel(BIT(irq & 0x1f), NVIC_ICPR_ADDR + (irq >> 5) * 4);
+}
+
+// Lower value is higher priority
+inline static void nvic_set_priority(uint32_t irq, uint8_t prio)
+{
+	write8(prio << (8 - NVIC_PRIO_BITS), NVIC_IPR_ADDR + irq);
+}
+
+// Table must be aligned to its size rounded up to power of 2
+inline static void nvic_set_vectors(const void *table)
+{
+	writel((uintptr_t)table, SCB_VTOR_ADDR);
+}
+
+#endif  // _NVIC_H
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "flash.h"
+#include "nvic.h"
+#include "position.h"
+
+#define POSITION_MARKER_VALID	0x5a5a
+#define POSITION_MARKER_FREE	0xffff
+#define POSITION_RECORDS	(POSITION_PAGE_SIZE / sizeof(struct position_record))
+#define POSITION_SLOTS_END	(POSITION_ADDR + POSITION_RECORDS * sizeof(struct position_record))
+
+// Address of the last written record or 0 if page is empty
+static volatile uintptr_t last_addr;
+static volatile bool is_valid;
+// Jobs of save or invalidate are queued, save from interrupt must not interfere with them
+static volatile bool is_busy;
+// Needles were moved while record was being saved: it is cleared right after program
+static volatile bool is_moved;
+// Record and job of position_save must stay valid until jobs are done
+static struct position_record pending;
+static struct flash_job job;
+static const uint16_t zero;
+
+static uint16_t position_check(struct position_record *rec)
+{
+	uint16_t *data = (uint16_t *)rec;
+	uint16_t sum = 0;
+
+	// All fields except marker and check itself
+	for (int i = 1; i < sizeof(*rec) / 2 - 1; i++)
+		sum += data[i];
+
+	return ~sum;
+}
+
+static uintptr_t position_find_last(void)
+{
+	uintptr_t addr = 0;
+
+	for (int i = 0; i < POSITION_RECORDS; i++) {
+		uintptr_t rec_addr = POSITION_ADDR + i * sizeof(struct position_record);
+
+		if (read16(rec_addr) == POSITION_MARKER_FREE)
+			break;
+
+		addr = rec_addr;
+	}
+
+	return addr;
+}
+
+int position_load(struct motor *motors, unsigned int count, uint16_t *warm_boots)
+{
+	struct position_record rec;
+
+	is_valid = false;
+	last_addr = position_find_last();
+	if (!last_addr)
+		return -1;
+
+	memcpy(&rec, (void *)last_addr, sizeof(rec));
+	if (rec.marker != POSITION_MARKER_VALID || rec.check != position_check(&rec))
+		return -1;
+
+	if (count > POSITION_MAX_MOTORS)
+		count = POSITION_MAX_MOTORS;
+
+	for (unsigned int i = 0; i < count; i++) {
+		motors[i].current = rec.pos[i];
+		motors[i].target = rec.pos[i];
+	}
+
+	if (warm_boots)
+		*warm_boots = rec.warm_boots;
+
+	is_valid = true;
+
+	return 0;
+}
+
+static void position_fill(struct position_record *rec, struct motor *motors, unsigned int count,
+			  uint16_t warm_boots)
+{
+	memset(rec, 0xff, sizeof(*rec));
+	rec->marker = POSITION_MARKER_VALID;
+	rec->warm_boots = warm_boots;
+	if (count > POSITION_MAX_MOTORS)
+		count = POSITION_MAX_MOTORS;
+
+	for (unsigned int i = 0; i < count; i++)
+		rec->pos[i] = motors[i].current;
+
+	rec->check = position_check(rec);
+}
+
+static void position_job_done(struct flash_job *j, int res);
+
+static int position_submit(uint8_t type, uintptr_t addr, const void *data, unsigned int len)
+{
+	job.type = type;
+	job.addr = addr;
+	job.data = data;
+	job.len = len;
+	job.done = position_job_done;
+
+	return flash_job_submit(&job);
+}
+
+// Called from flash interrupt: erase is followed by program, program by clear if needles moved
+static void position_job_done(struct flash_job *j, int res)
+{
+	if (j->type == FLASH_JOB_ERASE) {
+		if (res || position_submit(FLASH_JOB_PROGRAM, POSITION_ADDR, &pending, sizeof(pending)))
+			is_busy = false;
+
+		return;
+	}
+
+	if (j->data == &zero) {
+		is_busy = false;
+		return;
+	}
+
+	// Broken record is skipped on the next save
+	last_addr = j->addr;
+	if (res || !is_moved) {
+		is_valid = !res;
+		is_busy = false;
+		return;
+	}
+
+	if (position_submit(FLASH_JOB_PROGRAM, j->addr, &zero, sizeof(zero)))
+		is_busy = false;
+}
+
+// The last slot of the page is reserved for emergency save, which can't wait for page erase
+int position_save(struct motor *motors, unsigned int count, uint16_t warm_boots)
+{
+	uintptr_t addr = last_addr ? last_addr + sizeof(pending) : POSITION_ADDR;
+	int res;
+
+	if (is_busy)
+		return -1;
+
+	position_fill(&pending, motors, count, warm_boots);
+	is_moved = false;
+	is_busy = true;
+	if (addr >= POSITION_SLOTS_END - sizeof(pending))
+		res = position_submit(FLASH_JOB_ERASE, POSITION_ADDR, NULL, 0);
+	else
+		res = position_submit(FLASH_JOB_PROGRAM, addr, &pending, sizeof(pending));
+
+	if (res)
+		is_busy = false;
+
+	return res;
+}
+
+// Called from interrupt on power loss: no page erase here
+int position_save_emergency(struct motor *motors, unsigned int count, uint16_t warm_boots)
+{
+	uintptr_t addr = last_addr ? last_addr + sizeof(struct position_record) : POSITION_ADDR;
+	struct position_record rec;
+	int res;
+
+	// Flash interrupt can't complete queued jobs while this one is running, and interrupted
+	// synchronous erase or program of env would fail after nested one locks flash
+	if (is_busy || flash_is_busy())
+		return -1;
+
+	if (is_valid)
+		return 0;
+
+	if (addr >= POSITION_SLOTS_END)
+		return -1;
+
+	position_fill(&rec, motors, count, warm_boots);
+	res = flash_program(addr, &rec, sizeof(rec));
+	if (!res)
+		res = flash_verify(addr, &rec, sizeof(rec));
+
+	// Broken record is skipped on the next save
+	last_addr = addr;
+	is_valid = !res;
+
+	return res;
+}
+
+// Flash allows to program 0x0000 over already programmed halfword
+int position_invalidate(void)
+{
+	int res = 0;
+
+	// Save can be completed by flash interrupt meanwhile
+	nvic_disable_irq(IRQ_FLASH);
+	if (is_busy) {
+		is_moved = true;
+	} else if (is_valid) {
+		is_valid = false;
+		is_busy = true;
+		res = position_submit(FLASH_JOB_PROGRAM, last_addr, &zero, sizeof(zero));
+		if (res)
+			is_busy = false;
+	}
+	nvic_enable_irq(IRQ_FLASH);
+
+	return res;
+}
+
+bool position_is_valid(void)
+{
+	return is_valid;
+}
@@ -0,0 +1,31 @@
+#ifndef _POSITION_H
+#define _POSITION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "motor.h"
+
+// Page before environment
+#define POSITION_ADDR		0x0801f800
+#define POSITION_PAGE_SIZE	0x400
+#define POSITION_MAX_MOTORS	4
+
+struct position_record {
+	uint16_t marker;  // cleared to 0 when needles are moved after save
+	uint16_t warm_boots;  // boots without homing since the last full homing
+	int16_t pos[POSITION_MAX_MOTORS];
+	uint16_t reserved;
+	uint16_t check;
+};
+
+// Returns 0 and fills positions of motors if the last saved record is still valid
+int position_load(struct motor *motors, unsigned int count, uint16_t *warm_boots);
+// Record is programmed by flash jobs in background, position_is_valid() is true when it is done.
+// Returns -1 if previous save is not completed yet
+int position_save(struct motor *motors, unsigned int count, uint16_t warm_boots);
+int position_save_emergency(struct motor *motors, unsigned int count, uint16_t warm_boots);
+int position_invalidate(void);
+bool position_is_valid(void);
+
+#endif  // _POSITION_H
@@ -0,0 +1,251 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "common.h"
+#include "proto.h"
+#include "usart.h"
+
+uint16_t proto_crc16(uint16_t crc, uint8_t *data, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (int j = 0; j < 8; j++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+// Every zero byte is replaced by distance to the next one, so 0x00 is used only as delimiter
+static unsigned int cobs_encode(uint8_t *src, unsigned int len, uint8_t *dst)
+{
+	unsigned int code_pos = 0;
+	unsigned int pos = 1;
+	uint8_t code = 1;
+
+	for (unsigned int i = 0; i < len; i++) {
+		if (src[i]) {
+			dst[pos++] = src[i];
+			code++;
+		}
+
+		if (!src[i] || code == 0xff) {
+			dst[code_pos] = code;
+			code = 1;
+			code_pos = pos++;
+		}
+	}
+
+	dst[code_pos] = code;
+
+	return pos;
+}
+
+// Returns decoded length or -1 on broken frame
+static int cobs_decode(uint8_t *src, unsigned int len, uint8_t *dst, unsigned int size)
+{
+	unsigned int pos = 0;
+	unsigned int i = 0;
+
+	while (i < len) {
+		uint8_t code = src[i++];
+
+		if (!code || i + code - 1 > len)
+			return -1;
+
+		for (int j = 1; j < code; j++) {
+			if (pos >= size)
+				return -1;
+			dst[pos++] = src[i++];
+		}
+
+		if (code != 0xff && i < len) {
+			if (pos >= size)
+				return -1;
+			dst[pos++] = 0;
+		}
+	}
+
+	return pos;
+}
+
+// Returns size of encoded frame with delimiter
+static unsigned int proto_encode(uint8_t id, uint8_t seq, void *payload, unsigned int len,
+				 uint8_t *buf)
+{
+	uint8_t frame[PROTO_FRAME_SIZE];
+	unsigned int size;
+	uint16_t crc;
+
+	frame[0] = id;
+	frame[1] = seq;
+	memcpy(&frame[2], payload, len);
+	crc = proto_crc16(0xffff, frame, len + 2);
+	frame[len + 2] = crc & 0xff;
+	frame[len + 3] = crc >> 8;
+
+	size = cobs_encode(frame, len + 4, buf);
+	buf[size++] = 0;
+
+	return size;
+}
+
+int proto_send(struct proto *p, uint8_t id, uint8_t seq, void *payload, unsigned int len)
+{
+	uint8_t buf[PROTO_COBS_SIZE];
+	unsigned int size;
+
+	if (len > PROTO_MAX_PAYLOAD)
+		return -1;
+
+	size = proto_encode(id, seq, payload, len, buf);
+	usart_write(p->num, buf, size);
+
+	return 0;
+}
+
+int proto_try_send(struct proto *p, uint8_t id, uint8_t seq, void *payload, unsigned int len)
+{
+	uint8_t buf[PROTO_COBS_SIZE];
+	unsigned int size;
+
+	if (len > PROTO_MAX_PAYLOAD)
+		return -1;
+
+	size = proto_encode(id, seq, payload, len, buf);
+
+	return usart_try_write(p->num, buf, size) ? 0 : -1;
+}
+
+static void proto_send_status(struct proto *p, uint8_t id, uint8_t seq, uint8_t status)
+{
+	proto_send(p, id | PROTO_RESP, seq, &status, 1);
+}
+
+static void proto_hello(struct proto *p, uint8_t seq)
+{
+	uint8_t resp[1 + sizeof(struct proto_hello)] = {
+		PROTO_OK,
+		PROTO_VERSION,
+		PROTO_MAX_PAYLOAD,
+	};
+
+	proto_send(p, PROTO_MSG_HELLO | PROTO_RESP, seq, resp, sizeof(resp));
+}
+
+void proto_init(struct proto *p, uint8_t num, const struct proto_handler *handlers,
+		unsigned int count)
+{
+	memset(p, 0, sizeof(*p));
+	p->num = num;
+	p->handlers = handlers;
+	p->handlers_count = count;
+}
+
+bool proto_detect(struct proto *p, uint8_t ch)
+{
+	p->hello_msg = (p->hello_msg << 8) | ch;
+	if (p->hello_msg != PROTO_HELLO_MESSAGE)
+		return false;
+
+	p->hello_msg = 0;
+	p->rx_pos = 0;
+	p->rx_tick = HAL_GetTick();
+	p->is_active = true;
+	// Leading delimiter separates response from echo of text console
+	usart_send_byte(p->num, 0);
+	proto_hello(p, 0);
+
+	return true;
+}
+
+static void proto_handle(struct proto *p, uint8_t *frame, unsigned int len)
+{
+	uint8_t resp[PROTO_MAX_PAYLOAD];
+	unsigned int resp_len = 0;
+	uint8_t id = frame[0];
+	uint8_t seq = frame[1];
+	uint8_t *req = &frame[2];
+
+	len -= 2;
+	p->rx_seq = seq;
+	if (id == PROTO_MSG_HELLO) {
+		proto_hello(p, seq);
+		return;
+	}
+
+	if (id == PROTO_MSG_CLOSE) {
+		proto_send_status(p, id, seq, PROTO_OK);
+		p->is_active = false;
+		return;
+	}
+
+	for (unsigned int i = 0; i < p->handlers_count; i++) {
+		const struct proto_handler *h = &p->handlers[i];
+
+		if (h->id != id)
+			continue;
+
+		if (len != h->req_len) {
+			proto_send_status(p, id, seq, PROTO_ERR_LEN);
+			return;
+		}
+
+		resp[0] = h->func(p, req, &resp[1], &resp_len);
+		if (resp[0] != PROTO_OK)
+			resp_len = 0;
+
+		proto_send(p, id | PROTO_RESP, seq, resp, resp_len + 1);
+		return;
+	}
+
+	proto_send_status(p, id, seq, PROTO_ERR_UNKNOWN);
+}
+
+void proto_recv_byte(struct proto *p, uint8_t ch)
+{
+	uint8_t frame[PROTO_FRAME_SIZE];
+	uint16_t crc;
+	int len;
+
+	if (ch) {
+		if (p->rx_pos < sizeof(p->rx))
+			p->rx[p->rx_pos] = ch;
+
+		p->rx_pos++;
+		return;
+	}
+
+	if (!p->rx_pos)
+		return;
+
+	len = -1;
+	if (p->rx_pos <= sizeof(p->rx))
+		len = cobs_decode(p->rx, p->rx_pos, frame, sizeof(frame));
+
+	p->rx_pos = 0;
+	if (len < 4) {
+		p->frame_errors++;
+		return;
+	}
+
+	crc = frame[len - 2] | (frame[len - 1] << 8);
+	if (crc != proto_crc16(0xffff, frame, len - 2)) {
+		p->crc_errors++;
+		return;
+	}
+
+	p->rx_tick = HAL_GetTick();
+	p->rx_frames++;
+	proto_handle(p, frame, len - 2);
+}
+
+void proto_process(struct proto *p)
+{
+	if (p->is_active && HAL_GetTick() - p->rx_tick > PROTO_IDLE_TIMEOUT) {
+		p->is_active = false;
+		p->rx_pos = 0;
+	}
+}
@@ -0,0 +1,136 @@
+#ifndef _PROTO_H
+#define _PROTO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Binary protocol on the console USART. Text console switches to it after receiving
+// PROTO_HELLO_MESSAGE (same way as bootloader HELLO_MESSAGE) and returns back after
+// PROTO_MSG_CLOSE or PROTO_IDLE_TIMEOUT without valid frames.
+//
+// Frame: COBS encoded [id][seq][payload...][crc16 LE], terminated by 0x00.
+// CRC16 is CCITT (poly 0x1021, init 0xffff) as in bootloader, calculated over id, seq and payload.
+// Response has id | PROTO_RESP, the same seq and status as first byte of payload.
+// All numbers are little-endian.
+
+#define PROTO_HELLO_MESSAGE	0xaa03553a
+#define PROTO_VERSION		1
+#define PROTO_MAX_PAYLOAD	64
+#define PROTO_IDLE_TIMEOUT	10000  // ms
+
+#define PROTO_FRAME_SIZE	(PROTO_MAX_PAYLOAD + 4)  // with id, seq and crc
+#define PROTO_COBS_SIZE		(PROTO_FRAME_SIZE + PROTO_FRAME_SIZE / 254 + 2)  // with delimiter
+
+#define PROTO_RESP		0x80
+
+// Message IDs
+#define PROTO_MSG_HELLO		0x01  // resp: struct proto_hello
+#define PROTO_MSG_CLOSE		0x02  // return to text console
+// req: uint32_t baudrate. Device switches after response and returns to 115200 if no correct
+// frames are received in 5 s
+#define PROTO_MSG_BAUDRATE	0x03
+#define PROTO_MSG_ENV_GET	0x10  // req: uint8_t index, resp: struct proto_env
+#define PROTO_MSG_ENV_SET	0x11  // req: uint8_t index, uint32_t value
+#define PROTO_MSG_ENV_SAVE	0x12
+#define PROTO_MSG_ADC		0x20  // resp: struct proto_adc
+#define PROTO_MSG_MOTOR		0x21  // req: uint8_t index, resp: struct proto_motor
+#define PROTO_MSG_SUBSCRIBE	0x30  // req: uint8_t signals, uint16_t period (see telemetry.h)
+#define PROTO_MSG_TELEMETRY	0x40  // sent by device without request, seq is 0
+// Sent by device after PROTO_MSG_READ with its seq: uint32_t offset from the start of read, data
+#define PROTO_MSG_READ_DATA	0x41
+#define PROTO_MSG_READ		0x50  // req: struct proto_read, resp: uint32_t length (see bulk.h)
+#define PROTO_MSG_READ_ACK	0x51  // req: uint32_t offset of received data, uint8_t flags
+
+// Status of response
+#define PROTO_OK		0
+#define PROTO_ERR_UNKNOWN	1  // unknown message ID
+#define PROTO_ERR_LEN		2  // wrong length of request
+#define PROTO_ERR_ARG		3  // wrong argument (index is out of range)
+#define PROTO_ERR_FAIL		4  // request is correct, but operation failed
+
+struct proto_hello {
+	uint8_t version;
+	uint8_t max_payload;
+} __attribute__((packed));
+
+struct proto_env {
+	uint8_t index;
+	uint32_t value;
+	char name[16];  // null-padded
+} __attribute__((packed));
+
+struct proto_adc {
+	uint32_t value;
+	uint32_t run_tick;
+	uint16_t last;  // last filtered sample
+	uint8_t values_pos;
+	uint8_t flags;  // PROTO_ADC_*
+} __attribute__((packed));
+
+#define PROTO_ADC_DEBUG		BIT(0)
+#define PROTO_ADC_WRAPPED	BIT(1)
+
+struct proto_motor {
+	uint8_t index;
+	uint8_t flags;  // PROTO_MOTOR_*
+	uint16_t backlash_left;
+	int32_t current;
+	int32_t target;
+	uint32_t steps_count;
+	uint32_t dir_changes;
+	uint32_t park_done;
+	uint32_t step_tick;
+	char name[8];  // null-padded
+} __attribute__((packed));
+
+#define PROTO_MOTOR_FORWARD	BIT(0)
+#define PROTO_MOTOR_PARKING	BIT(1)
+#define PROTO_MOTOR_STALLED	BIT(2)
+#define PROTO_MOTOR_DEBUG	BIT(3)
+
+struct proto_read {
+	uint8_t region;  // BULK_REGION_*
+	uint32_t addr;
+	uint32_t len;
+} __attribute__((packed));
+
+#define PROTO_READ_RETRY	BIT(0)  // send data again from offset
+
+struct proto {
+	const struct proto_handler *handlers;
+	unsigned int handlers_count;
+	uint8_t rx[PROTO_COBS_SIZE];
+	unsigned int rx_pos;
+	uint32_t rx_tick;
+	uint32_t hello_msg;
+	uint32_t rx_frames;  // correct frames
+	uint32_t crc_errors;
+	uint32_t frame_errors;
+	uint8_t rx_seq;  // of request which is being handled
+	uint8_t num;
+	bool is_active;
+};
+
+// Handler fills response payload (after status byte) and returns status
+struct proto_handler {
+	uint8_t id;
+	uint8_t req_len;
+	uint8_t (*func)(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+};
+
+void proto_init(struct proto *p, uint8_t num, const struct proto_handler *handlers,
+		unsigned int count);
+// Is called for every byte of text console, returns true when binary protocol is started
+bool proto_detect(struct proto *p, uint8_t ch);
+void proto_recv_byte(struct proto *p, uint8_t ch);
+// Returns to text console on idle timeout
+void proto_process(struct proto *p);
+int proto_send(struct proto *p, uint8_t id, uint8_t seq, void *payload, unsigned int len);
+// Whole frame is queued or dropped (returns -1), never waits for transmit buffer
+int proto_try_send(struct proto *p, uint8_t id, uint8_t seq, void *payload, unsigned int len);
+
+uint16_t proto_crc16(uint16_t crc, uint8_t *data, unsigned int len);
+
+#endif  // _PROTO_H
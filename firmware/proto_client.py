@@ -0,0 +1,512 @@
+#!/usr/bin/env python
+
+import argparse
+import struct
+import time
+
+import serial
+
+
+HELLO_MESSAGE = b"\xaa\x03\x55\x3a"
+RESP = 0x80
+MSG_HELLO = 0x01
+MSG_CLOSE = 0x02
+MSG_BAUDRATE = 0x03
+MSG_ENV_GET = 0x10
+MSG_ENV_SET = 0x11
+MSG_ENV_SAVE = 0x12
+MSG_ADC = 0x20
+MSG_MOTOR = 0x21
+MSG_SUBSCRIBE = 0x30
+MSG_TELEMETRY = 0x40
+MSG_READ_DATA = 0x41
+MSG_READ = 0x50
+MSG_READ_ACK = 0x51
+
+STATUS = {
+    0: "ok",
+    1: "unknown message",
+    2: "wrong length",
+    3: "wrong argument",
+    4: "failed",
+}
+
+ERR_ARG = 3
+READ_RETRY = 1
+
+# Layouts of records from proto.h (little-endian, packed)
+HELLO_RECORD = struct.Struct("<BB")
+ENV_RECORD = struct.Struct("<BI16s")
+ADC_RECORD = struct.Struct("<IIHBB")
+MOTOR_RECORD = struct.Struct("<BBHiiIIII8s")
+TELEMETRY_HDR = struct.Struct("<IHBB")
+READ_REQ = struct.Struct("<BII")
+READ_ACK = struct.Struct("<IB")
+LOG_BLOCK = struct.Struct("<HHIIHHHBB")
+
+# Signals of telemetry.h in order of bits
+SIGNALS = ["adc_raw", "adc_value", "target", "current", "alert", "loop"]
+KEEPALIVE_PERIOD = 2  # seconds, device returns to text console after 10 s without frames
+
+# Regions of bulk read (bulk.h)
+REGIONS = {"flash": 0, "log": 1}
+FLASH_BASE = 0x08000000
+FLASH_SIZE = 0x20000
+READ_ACK_CHUNKS = 8  # device sends up to 16 chunks without acknowledgement
+READ_RETRIES = 5
+
+# Fuel log (logger.h)
+LOG_PAGE_SIZE = 0x400
+LOG_BLOCK_SIZE = LOG_PAGE_SIZE - 4  # full page is closed by CRC-32
+LOG_SIZE = 58 * LOG_PAGE_SIZE
+LOG_BLOCK_MAGIC = 0x4c47
+LOG_TAG_RUN_MAX = 0x7f
+LOG_TAG_PAD = 0xff
+LOG_FIELDS = ["time", "level", "raw_min", "raw_max", "flags"]
+
+
+def crc16(data):
+    crc = 0xffff
+    for x in data:
+        crc ^= x << 8
+        for _ in range(8):
+            crc = ((crc << 1) & 0xffff) ^ 0x1021 if crc & 0x8000 else crc << 1
+
+        crc &= 0xffff
+
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray(b"\x00")
+    code_pos = 0
+    code = 1
+    for x in data:
+        if x:
+            out.append(x)
+            code += 1
+
+        if not x or code == 0xff:
+            out[code_pos] = code
+            code = 1
+            code_pos = len(out)
+            out.append(0)
+
+    out[code_pos] = code
+
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        i += 1
+        if not code or i + code - 1 > len(data):
+            raise ValueError("broken COBS frame")
+
+        out += data[i:i + code - 1]
+        i += code - 1
+        if code != 0xff and i < len(data):
+            out.append(0)
+
+    return bytes(out)
+
+
+def read_varint(data, pos):
+    value = 0
+    for shift in range(0, 35, 7):
+        if pos >= len(data):
+            break
+
+        value |= (data[pos] & 0x7f) << shift
+        pos += 1
+        if not data[pos - 1] & 0x80:
+            return value, pos
+
+    raise ValueError("broken varint")
+
+
+def crc32_stm32(data):
+    """CRC-32 of STM32 unit: 32-bit little-endian words, no reflection and final xor"""
+    crc = 0xffffffff
+    for pos in range(0, len(data), 4):
+        crc ^= int.from_bytes(data[pos:pos + 4], "little")
+        for _ in range(32):
+            crc = ((crc << 1) ^ 0x04c11db7 if crc & 0x80000000 else crc << 1) & 0xffffffff
+
+    return crc
+
+
+def zigzag_decode(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def decode_log_block(block):
+    """Records of one page of fuel log (see encoding in logger.h)"""
+    if len(block) < LOG_BLOCK.size:
+        return
+
+    magic, period, seq, time_, level, raw_min, raw_max, flags, check = LOG_BLOCK.unpack_from(block)
+    if magic != LOG_BLOCK_MAGIC or check != ~sum(block[:LOG_BLOCK.size - 1]) & 0xff:
+        return
+
+    crc = int.from_bytes(block[LOG_BLOCK_SIZE:LOG_PAGE_SIZE], "little")
+    block = block[:LOG_BLOCK_SIZE]
+    if len(block) == LOG_BLOCK_SIZE and crc != 0xffffffff and crc != crc32_stm32(block):
+        return
+
+    rec = {"seq": seq, "time": time_, "level": level, "raw_min": raw_min, "raw_max": raw_max, "flags": flags}
+    yield dict(rec)
+    pos = LOG_BLOCK.size
+    while pos < len(block):
+        tag = block[pos]
+        pos += 1
+        if tag == LOG_TAG_PAD:
+            continue
+
+        if tag <= LOG_TAG_RUN_MAX:
+            for _ in range(tag + 1):
+                rec["seq"] += 1
+                rec["time"] += period
+                yield dict(rec)
+            continue
+
+        if tag & ~0x1f != 0x80:
+            return
+
+        rec["seq"] += 1
+        rec["time"] += period
+        try:
+            for bit, name in enumerate(LOG_FIELDS):
+                if not tag & (1 << bit):
+                    continue
+
+                if name == "flags":
+                    rec[name] = block[pos]
+                    pos += 1
+                else:
+                    value, pos = read_varint(block, pos)
+                    rec[name] += zigzag_decode(value)
+                    if name != "time":
+                        rec[name] &= 0xffff
+        except (ValueError, IndexError):
+            return
+
+        yield dict(rec)
+
+
+def decode_log(data):
+    for pos in range(0, len(data), LOG_PAGE_SIZE):
+        yield from decode_log_block(data[pos:pos + LOG_PAGE_SIZE])
+
+
+def parse_telemetry(payload):
+    tick, dropped, signals, motors_count = TELEMETRY_HDR.unpack_from(payload)
+    rec = {"tick": tick, "dropped": dropped}
+    pos = TELEMETRY_HDR.size
+    for bit, name in enumerate(SIGNALS):
+        if not signals & (1 << bit):
+            continue
+
+        if name in ("target", "current"):
+            rec[name] = list(struct.unpack_from(f"<{motors_count}h", payload, pos))
+            pos += 2 * motors_count
+        elif name == "alert":
+            rec[name] = payload[pos]
+            pos += 1
+        elif name == "loop":
+            rec["loop_max_us"], rec["loops"] = struct.unpack_from("<HH", payload, pos)
+            pos += 4
+        else:
+            rec[name], = struct.unpack_from("<H", payload, pos)
+            pos += 2
+
+    return rec
+
+
+class Proto:
+    def __init__(self, tty):
+        self.tty = tty
+        self.seq = 0
+
+    def read_frame(self):
+        data = b""
+        while True:
+            ch = self.tty.read(1)
+            if not ch:
+                raise TimeoutError("Timeout while waiting for frame")
+
+            if ch != b"\x00":
+                data += ch
+                continue
+
+            if not data:
+                continue
+
+            try:
+                frame = cobs_decode(data)
+            except ValueError:
+                frame = b""
+
+            data = b""
+            # Echo of text console before start of protocol is dropped here
+            if len(frame) < 4 or crc16(frame[:-2]) != int.from_bytes(frame[-2:], "little"):
+                continue
+
+            return frame[0], frame[1], frame[2:-2]
+
+    def start(self):
+        self.tty.reset_input_buffer()
+        self.tty.write(HELLO_MESSAGE)
+        msg_id, _, payload = self.read_frame()
+        if msg_id != MSG_HELLO | RESP or payload[0]:
+            raise Exception(f"Wrong response for HELLO ({msg_id:#x})")
+
+        version, max_payload = HELLO_RECORD.unpack(payload[1:])
+        return version, max_payload
+
+    def send(self, msg_id, payload=b""):
+        self.seq = (self.seq + 1) & 0xff
+        frame = bytes([msg_id, self.seq]) + payload
+        frame += crc16(frame).to_bytes(length=2, byteorder="little")
+        self.tty.write(cobs_encode(frame) + b"\x00")
+
+    def request(self, msg_id, payload=b""):
+        self.send(msg_id, payload)
+        while True:
+            resp_id, seq, resp = self.read_frame()
+            if resp_id == msg_id | RESP and seq == self.seq:
+                return resp[0], resp[1:]
+
+    def check(self, status, what):
+        if status:
+            raise Exception(f"{what}: {STATUS.get(status, status)}")
+
+    def switch_baudrate(self, baudrate):
+        status, _ = self.request(MSG_BAUDRATE, struct.pack("<I", baudrate))
+        self.check(status, "baudrate")
+        # Device switches after response is sent
+        time.sleep(0.05)
+        self.tty.baudrate = baudrate
+        self.tty.reset_input_buffer()
+        # Any correct frame at new baudrate confirms it
+        self.request(MSG_HELLO)
+
+    def close(self):
+        self.request(MSG_CLOSE)
+
+    def env_list(self):
+        index = 0
+        while True:
+            status, resp = self.request(MSG_ENV_GET, bytes([index]))
+            if status == ERR_ARG:
+                break
+
+            self.check(status, "env_get")
+            _, value, name = ENV_RECORD.unpack(resp)
+            yield index, name.rstrip(b"\x00").decode(), value
+            index += 1
+
+    def env_set(self, index, value):
+        status, _ = self.request(MSG_ENV_SET, struct.pack("<BI", index, value))
+        self.check(status, "env_set")
+
+    def env_save(self):
+        status, _ = self.request(MSG_ENV_SAVE)
+        self.check(status, "env_save")
+
+    def adc(self):
+        status, resp = self.request(MSG_ADC)
+        self.check(status, "adc")
+        value, run_tick, last, values_pos, flags = ADC_RECORD.unpack(resp)
+        return {
+            "value": value,
+            "run_tick": run_tick,
+            "last": last,
+            "values_pos": values_pos,
+            "is_debug": bool(flags & 1),
+            "is_values_wrapped": bool(flags & 2),
+        }
+
+    def subscribe(self, signals, period):
+        status, _ = self.request(MSG_SUBSCRIBE, struct.pack("<BH", signals, period))
+        self.check(status, "subscribe")
+
+    def stream(self):
+        keepalive = time.monotonic()
+        while True:
+            if time.monotonic() - keepalive > KEEPALIVE_PERIOD:
+                self.request(MSG_HELLO)
+                keepalive = time.monotonic()
+
+            msg_id, _, payload = self.read_frame()
+            if msg_id == MSG_TELEMETRY:
+                yield parse_telemetry(payload)
+
+    def read(self, region, addr, length, progress=None):
+        """Bulk read: data frames are acknowledged by host, lost ones are requested again"""
+        status, resp = self.request(MSG_READ, READ_REQ.pack(REGIONS[region], addr, length))
+        self.check(status, "read")
+        length, = struct.unpack("<I", resp)
+        seq = self.seq
+        data = bytearray()
+        acked = 0
+        chunk = 0
+        retries = 0
+        is_retry = False
+        while len(data) < length:
+            try:
+                msg_id, frame_seq, payload = self.read_frame()
+            except TimeoutError:
+                retries += 1
+                if retries > READ_RETRIES:
+                    raise
+
+                # The last chunks are lost: there is nothing after them to notice a gap
+                self.send(MSG_READ_ACK, READ_ACK.pack(len(data), READ_RETRY))
+                is_retry = True
+                continue
+
+            # Responses to acknowledgements are not waited for
+            if msg_id != MSG_READ_DATA or frame_seq != seq:
+                continue
+
+            offset, = struct.unpack_from("<I", payload)
+            if offset != len(data):
+                # Frames which were sent before retry are skipped
+                if offset > len(data) and not is_retry:
+                    self.send(MSG_READ_ACK, READ_ACK.pack(len(data), READ_RETRY))
+                    is_retry = True
+                continue
+
+            is_retry = False
+            retries = 0
+            chunk = chunk or len(payload) - 4
+            data += payload[4:]
+            if len(data) - acked >= READ_ACK_CHUNKS * chunk or len(data) == length:
+                self.send(MSG_READ_ACK, READ_ACK.pack(len(data), 0))
+                acked = len(data)
+                if progress:
+                    progress(len(data), length)
+
+        return bytes(data)
+
+    def motors(self):
+        index = 0
+        while True:
+            status, resp = self.request(MSG_MOTOR, bytes([index]))
+            if status == ERR_ARG:
+                break
+
+            self.check(status, "motor")
+            (_, flags, backlash_left, current, target, steps_count, dir_changes, park_done,
+             step_tick, name) = MOTOR_RECORD.unpack(resp)
+            yield {
+                "name": name.rstrip(b"\x00").decode(),
+                "current": current,
+                "target": target,
+                "backlash_left": backlash_left,
+                "steps_count": steps_count,
+                "dir_changes": dir_changes,
+                "park_done": park_done,
+                "step_tick": step_tick,
+                "dir_is_forward": bool(flags & 1),
+                "is_parking": bool(flags & 2),
+                "is_stalled": bool(flags & 4),
+                "is_debug": bool(flags & 8),
+            }
+            index += 1
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("cmd", choices=["env", "setenv", "saveenv", "adc", "motor", "stream", "read", "log"], help="request to device")
+    parser.add_argument("args", nargs="*", help=f"for setenv: name and value, for stream: signals ({', '.join(SIGNALS)}), "
+                        "for read: region (flash or log) and for flash address and length, for log: from and to time (s)")
+    parser.add_argument("-o", "--output", help="file for read (required) and log")
+    parser.add_argument("-s", "--switch-baudrate", type=int, help="switch device and serial port to this speed before request")
+    parser.add_argument("-r", "--period", type=int, default=100, help="period of stream records (ms)")
+    parser.add_argument("-p", "--port", default="/dev/ttyUSB0", help="serial port")
+    parser.add_argument("-b", "--baudrate", type=int, default=115200, help="speed of serial port")
+    args = parser.parse_args()
+
+    tty = serial.Serial(port=args.port, baudrate=args.baudrate, timeout=2)
+    proto = Proto(tty)
+    version, _ = proto.start()
+    print(f"Protocol version: {version}")
+    if args.switch_baudrate:
+        proto.switch_baudrate(args.switch_baudrate)
+
+    try:
+        if args.cmd == "env":
+            for index, name, value in proto.env_list():
+                print(f"{index:2}  {name:16} {value}")
+        elif args.cmd == "setenv":
+            name, value = args.args
+            for index, env_name, _ in proto.env_list():
+                if env_name == name:
+                    proto.env_set(index, int(value, 0))
+                    break
+            else:
+                raise Exception(f"Environment variable '{name}' is not found")
+        elif args.cmd == "saveenv":
+            proto.env_save()
+        elif args.cmd == "adc":
+            for key, value in proto.adc().items():
+                print(f"{key:18} {value}")
+        elif args.cmd == "motor":
+            for motor in proto.motors():
+                for key, value in motor.items():
+                    print(f"{key:15} {value}")
+                print()
+        elif args.cmd == "stream":
+            signals = 0
+            for name in args.args or SIGNALS:
+                signals |= 1 << SIGNALS.index(name)
+
+            proto.subscribe(signals, args.period)
+            try:
+                for rec in proto.stream():
+                    print("  ".join(f"{key}={value}" for key, value in rec.items()))
+            except KeyboardInterrupt:
+                proto.subscribe(0, 0)
+        elif args.cmd == "read":
+            if not args.output:
+                raise Exception("Output file is required for read")
+
+            region = args.args[0] if args.args else "flash"
+            if region == "flash":
+                addr = int(args.args[1], 0) if len(args.args) > 1 else FLASH_BASE
+                length = int(args.args[2], 0) if len(args.args) > 2 else FLASH_BASE + FLASH_SIZE - addr
+            else:
+                addr, length = 0, LOG_SIZE
+
+            start = time.monotonic()
+            data = proto.read(region, addr, length,
+                              lambda done, total: print(f"\r{done} of {total} bytes", end="", flush=True))
+            elapsed = time.monotonic() - start
+            print(f"\n{len(data)} bytes in {elapsed:.1f} s ({len(data) / elapsed:.0f} bytes/s)")
+            with open(args.output, "wb") as f:
+                f.write(data)
+        elif args.cmd == "log":
+            time_from = int(args.args[0]) if args.args else 0
+            time_to = int(args.args[1]) if len(args.args) > 1 else 0xffffffff
+            lines = []
+            for rec in decode_log(proto.read("log", 0, LOG_SIZE)):
+                if time_from <= rec["time"] <= time_to:
+                    lines.append(f"{rec['seq']:8}  {rec['time']:8}  {rec['level']:5}  {rec['raw_min']:7}  "
+                                 f"{rec['raw_max']:7}  {rec['flags']:#x}")
+
+            if args.output:
+                with open(args.output, "w") as f:
+                    f.write("\n".join(lines) + "\n")
+            else:
+                print("\n".join(lines))
+    finally:
+        proto.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,22 @@
+#ifndef _PWR_H
+#define _PWR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef STM32F1
+#define PWR_PVD_2_2V 0
+#define PWR_PVD_2_3V 0x1
+#define PWR_PVD_2_4V 0x2
+#define PWR_PVD_2_5V 0x3
+#define PWR_PVD_2_6V 0x4
+#define PWR_PVD_2_7V 0x5
+#define PWR_PVD_2_8V 0x6
+#define PWR_PVD_2_9V 0x7
+#endif
+
+// PWR clock must be enabled before
+void pwr_pvd_init(uint32_t level);
+bool pwr_pvd_is_low(void);
+
+#endif  // _PWR_H
@@ -0,0 +1,28 @@
+#include "common.h"
+#include "pwr.h"
+
+#define PWR_BASE_ADDR 0x40007000
+
+#define REG_CR	(PWR_BASE_ADDR + 0)
+#define REG_CSR	(PWR_BASE_ADDR + 0x4)
+
+#define CR_DBP BIT(8)
+#define CR_PLS(x) ((x) << 5)
+#define CR_PLS_MASK CR_PLS(0x7)
+#define CR_PVDE BIT(4)
+
+#define CSR_PVDO BIT(2)
+
+void pwr_pvd_init(uint32_t level)
+{
+	uint32_t val = readl(REG_CR);
+
+	val = (val & ~CR_PLS_MASK) | CR_PLS(level) | CR_PVDE;
+	writel(val, REG_CR);
+}
+
+// VDD is below PVD threshold
+bool pwr_pvd_is_low(void)
+{
+	return !!(readl(REG_CSR) & CSR_PVDO);
+}
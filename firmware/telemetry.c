@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#include "common.h"
+#include "telemetry.h"
+
+struct telemetry {
+	struct proto *proto;
+	struct motor *motors;
+	unsigned int motors_count;
+	uint32_t send_tick;
+	uint16_t period;
+	uint16_t dropped;
+	uint8_t signals;
+
+	// Snapshot
+	uint16_t adc_raw;
+	uint16_t adc_value;
+	bool alert;
+	uint16_t loop_max;
+	uint16_t loops;
+};
+
+static struct telemetry telemetry;
+
+void telemetry_init(struct motor *motors, unsigned int count)
+{
+	memset(&telemetry, 0, sizeof(telemetry));
+	telemetry.motors = motors;
+	telemetry.motors_count = count;
+}
+
+void telemetry_adc(uint16_t raw, uint16_t value, bool alert)
+{
+	telemetry.adc_raw = raw;
+	telemetry.adc_value = value;
+	telemetry.alert = alert;
+}
+
+void telemetry_loop(uint32_t us)
+{
+	if (us > 0xffff)
+		us = 0xffff;
+
+	if (us > telemetry.loop_max)
+		telemetry.loop_max = us;
+
+	if (telemetry.loops < 0xffff)
+		telemetry.loops++;
+}
+
+uint8_t telemetry_subscribe(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len)
+{
+	uint16_t period = req[1] | (req[2] << 8);
+	uint8_t signals = req[0] & TELEMETRY_ALL;
+	unsigned int size = sizeof(struct telemetry_hdr);
+
+	if (period && period < TELEMETRY_MIN_PERIOD)
+		return PROTO_ERR_ARG;
+
+	for (int i = 0; i < 8; i++) {
+		if (!(signals & BIT(i)))
+			continue;
+
+		if (BIT(i) == TELEMETRY_TARGET || BIT(i) == TELEMETRY_CURRENT)
+			size += 2 * telemetry.motors_count;
+		else if (BIT(i) == TELEMETRY_ALERT)
+			size += 1;
+		else if (BIT(i) == TELEMETRY_LOOP)
+			size += 4;
+		else
+			size += 2;
+	}
+
+	if (size > PROTO_MAX_PAYLOAD)
+		return PROTO_ERR_ARG;
+
+	telemetry.proto = p;
+	telemetry.signals = period ? signals : 0;
+	telemetry.period = period;
+	telemetry.dropped = 0;
+	telemetry.send_tick = HAL_GetTick();
+
+	return PROTO_OK;
+}
+
+static uint8_t *telemetry_put16(uint8_t *p, uint16_t value)
+{
+	*p++ = value & 0xff;
+	*p++ = value >> 8;
+
+	return p;
+}
+
+void telemetry_process(void)
+{
+	uint8_t rec[PROTO_MAX_PAYLOAD];
+	struct telemetry_hdr hdr;
+	uint32_t tick = HAL_GetTick();
+	uint8_t *p = &rec[sizeof(hdr)];
+
+	// Subscription is closed together with binary protocol
+	if (telemetry.proto && !telemetry.proto->is_active)
+		telemetry.signals = 0;
+
+	if (!telemetry.signals || tick - telemetry.send_tick < telemetry.period)
+		return;
+
+	telemetry.send_tick = tick;
+	if (telemetry.signals & TELEMETRY_ADC_RAW)
+		p = telemetry_put16(p, telemetry.adc_raw);
+
+	if (telemetry.signals & TELEMETRY_ADC_VALUE)
+		p = telemetry_put16(p, telemetry.adc_value);
+
+	// Aligned 32-bit fields changed by timer tick are read atomically
+	if (telemetry.signals & TELEMETRY_TARGET) {
+		for (unsigned int i = 0; i < telemetry.motors_count; i++)
+			p = telemetry_put16(p, telemetry.motors[i].target);
+	}
+
+	if (telemetry.signals & TELEMETRY_CURRENT) {
+		for (unsigned int i = 0; i < telemetry.motors_count; i++)
+			p = telemetry_put16(p, telemetry.motors[i].current);
+	}
+
+	if (telemetry.signals & TELEMETRY_ALERT)
+		*p++ = telemetry.alert;
+
+	if (telemetry.signals & TELEMETRY_LOOP) {
+		p = telemetry_put16(p, telemetry.loop_max);
+		p = telemetry_put16(p, telemetry.loops);
+	}
+
+	hdr.tick = tick;
+	hdr.dropped = telemetry.dropped;
+	hdr.signals = telemetry.signals;
+	hdr.motors_count = telemetry.motors_count;
+	memcpy(rec, &hdr, sizeof(hdr));
+
+	if (proto_try_send(telemetry.proto, PROTO_MSG_TELEMETRY, 0, rec, p - rec)) {
+		if (telemetry.dropped < 0xffff)
+			telemetry.dropped++;
+		return;
+	}
+
+	// Loop statistics are collected per sent record
+	telemetry.loop_max = 0;
+	telemetry.loops = 0;
+}
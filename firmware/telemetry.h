@@ -0,0 +1,42 @@
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "motor.h"
+#include "proto.h"
+
+// Signals of PROTO_MSG_SUBSCRIBE. Record PROTO_MSG_TELEMETRY is struct telemetry_hdr and then
+// values of subscribed signals in order of bits (little-endian):
+#define TELEMETRY_ADC_RAW	BIT(0)  // uint16_t - last sample before filter
+#define TELEMETRY_ADC_VALUE	BIT(1)  // uint16_t - averaged value
+#define TELEMETRY_TARGET	BIT(2)  // int16_t for every motor
+#define TELEMETRY_CURRENT	BIT(3)  // int16_t for every motor
+#define TELEMETRY_ALERT		BIT(4)  // uint8_t - state of low fuel LED
+#define TELEMETRY_LOOP		BIT(5)  // uint16_t max main loop time (us), uint16_t loops count
+#define TELEMETRY_ALL		0x3f
+
+#define TELEMETRY_MIN_PERIOD	10  // ms
+
+struct telemetry_hdr {
+	uint32_t tick;
+	uint16_t dropped;  // records not sent because transmit buffer was full (total)
+	uint8_t signals;
+	uint8_t motors_count;
+} __attribute__((packed));
+
+void telemetry_init(struct motor *motors, unsigned int count);
+
+// Producers update snapshot at the moment when the value is produced
+void telemetry_adc(uint16_t raw, uint16_t value, bool alert);
+void telemetry_loop(uint32_t us);
+
+// Handler of PROTO_MSG_SUBSCRIBE: req is uint8_t signals, uint16_t period (ms, 0 - stop).
+// Records are sent to the last subscribed protocol instance
+uint8_t telemetry_subscribe(struct proto *p, uint8_t *req, uint8_t *resp, unsigned int *resp_len);
+// Called from main loop: sends record if period is elapsed, never waits for transmit buffer
+void telemetry_process(void);
+
+#endif  // _TELEMETRY_H
@@ -0,0 +1,14 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Configure timer to generate update interrupt with frequency freq (clk is timer input clock)
+void timer_init(uint8_t num, uint32_t clk, uint32_t freq);
+void timer_start(uint8_t num);
+void timer_stop(uint8_t num);
+bool timer_is_update(uint8_t num);
+void timer_clear_update(uint8_t num);
+
+#endif  // _TIMER_H
@@ -0,0 +1,92 @@
+#include "common.h"
+#include "timer.h"
+
+#define TIM2_BASE_ADDR 0x40000000
+#define TIM3_BASE_ADDR 0x40000400
+#define TIM4_BASE_ADDR 0x40000800
+#define TIM5_BASE_ADDR 0x40000c00
+
+#define CR1_ARPE BIT(7)
+#define CR1_URS BIT(2)
+#define CR1_CEN BIT(0)
+
+#define DIER_UIE BIT(0)
+
+#define SR_UIF BIT(0)
+
+#define EGR_UG BIT(0)
+
+// Prescaled counter clock
+#define TIMER_CNT_CLK 1000000
+
+typedef struct {
+	volatile uint32_t CR1;
+	volatile uint32_t CR2;
+	volatile uint32_t SMCR;
+	volatile uint32_t DIER;
+	volatile uint32_t SR;
+	volatile uint32_t EGR;
+	volatile uint32_t CCMR1;
+	volatile uint32_t CCMR2;
+	volatile uint32_t CCER;
+	volatile uint32_t CNT;
+	volatile uint32_t PSC;
+	volatile uint32_t ARR;
+} timer_regs_t;
+
+static RAMFUNC timer_regs_t *get_timer_regs(uint8_t num)
+{
+	switch (num) {
+	case 2:
+		return (timer_regs_t *)TIM2_BASE_ADDR;
+	case 3:
+		return (timer_regs_t *)TIM3_BASE_ADDR;
+	case 4:
+		return (timer_regs_t *)TIM4_BASE_ADDR;
+	case 5:
+		return (timer_regs_t *)TIM5_BASE_ADDR;
+	default:
+		return NULL;
+	}
+}
+
+void timer_init(uint8_t num, uint32_t clk, uint32_t freq)
+{
+	timer_regs_t *regs = get_timer_regs(num);
+
+	regs->CR1 = CR1_ARPE | CR1_URS;
+	regs->PSC = clk / TIMER_CNT_CLK - 1;
+	regs->ARR = TIMER_CNT_CLK / freq - 1;
+	regs->CNT = 0;
+	regs->EGR = EGR_UG;  // load prescaler
+	regs->SR = 0;
+	regs->DIER = DIER_UIE;
+}
+
+void timer_start(uint8_t num)
+{
+	timer_regs_t *regs = get_timer_regs(num);
+
+	regs->CR1 |= CR1_CEN;
+}
+
+void timer_stop(uint8_t num)
+{
+	timer_regs_t *regs = get_timer_regs(num);
+
+	regs->CR1 &= ~CR1_CEN;
+}
+
+bool timer_is_update(uint8_t num)
+{
+	timer_regs_t *regs = get_timer_regs(num);
+
+	return !!(regs->SR & SR_UIF);
+}
+
+RAMFUNC void timer_clear_update(uint8_t num)
+{
+	timer_regs_t *regs = get_timer_regs(num);
+
+	regs->SR = ~SR_UIF;
+}
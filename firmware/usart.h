@@ -1,21 +1,51 @@
 #ifndef _USART_H
 #define _USART_H
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+struct usart_stats {
+	uint32_t overrun;  // byte lost in data register
+	uint32_t framing;
+	uint32_t noise;
+	uint32_t dropped;  // receive buffer is full
+	uint32_t tx_dropped;  // transmit buffer is full (see policy)
+};
+
+// Policy of DMA transmit when buffer is full
+#define USART_TX_BLOCK 0  // wait for free space
+#define USART_TX_DROP 1  // drop data which does not fit
+#define USART_TX_TRUNCATE 2  // put marker and drop everything until buffer is sent
+
 void usart_init(uint8_t num, uint32_t pclk, uint32_t boudrate);
+// Waits until transmit is completed. Returns -1 if baudrate can't be reached with this pclk
+int usart_set_baudrate(uint8_t num, uint32_t pclk, uint32_t baudrate);
+// Real baudrate after rounding of divider
+uint32_t usart_get_baudrate(uint8_t num, uint32_t pclk);
+void usart_rx_irq_enable(uint8_t num);
+void usart_tx_dma_enable(uint8_t num, uint8_t policy);
+void usart_set_tx_policy(uint8_t num, uint8_t policy);
+void usart_get_stats(uint8_t num, struct usart_stats *stats);
 
+// Wait until all queued data is sent
 void usart_flush(uint8_t num);
 
 // For binary data sends as is
 void usart_send_byte(uint8_t num, uint8_t data);
 void usart_write(uint8_t num, void *ptr, int len);
+// Never waits: returns false (nothing is queued) if DMA buffer is not enabled or has no space
+bool usart_try_write(uint8_t num, void *ptr, int len);
+// Free space in transmit buffer. Without DMA buffer output is synchronous, so buffer size is
+// returned
+unsigned int usart_get_tx_free(uint8_t num);
 
 // For text data will correct end-of-line
 void usart_putc(uint8_t num, char c);
 void usart_puts(uint8_t num, char *s);
+// Format is described in format.h
 void usart_printf(uint8_t num, char *s, ...);
+void usart_vprintf(uint8_t num, char *s, va_list args);
 
 uint8_t usart_recv_byte(uint8_t num);
 uint8_t usart_wait_and_recv_byte(uint8_t num);
@@ -1,18 +1,38 @@
 #include <stdarg.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "common.h"
+#include "dma.h"
+#include "format.h"
+#include "nvic.h"
 #include "usart.h"
 
 #define SR_TXE BIT(7)
 #define SR_TC BIT(6)
 #define SR_RXNE BIT(5)
 #define SR_IDLE BIT(4)
+#define SR_ORE BIT(3)
+#define SR_NE BIT(2)
+#define SR_FE BIT(1)
 
 #define CR1_UE BIT(13)
+#define CR1_RXNEIE BIT(5)
 #define CR1_TE BIT(3)
 #define CR1_RE BIT(2)
 
+#define CR3_DMAT BIT(7)
+
+#define USART_BRR_MIN 16  // USARTDIV 1.0 gives maximum baudrate pclk / 16
+#define USART_BRR_MAX 0xffff
+
+// Receive and transmit buffers are supported for USART1..USART3
+#define USART_BUF_COUNT 3
+#define USART_RX_BUF_SIZE 256  // power of 2
+#define USART_TX_BUF_SIZE 512  // power of 2
+
+#define USART_TX_TRUNC_MARKER '~'
+
 #define USART1_BASE_ADDR 0x40013800
 #define USART2_BASE_ADDR 0x40004400
 #define USART3_BASE_ADDR 0x40004800
@@ -29,7 +49,33 @@ typedef struct {
 	volatile uint32_t GTPR;
 } usart_regs_t;
 
-static usart_regs_t *get_usart_regs(uint8_t num)
+struct usart_rx {
+	uint8_t buf[USART_RX_BUF_SIZE];
+	volatile uint16_t head;  // changed by interrupt only
+	volatile uint16_t tail;
+	bool is_enabled;
+	struct usart_stats stats;
+};
+
+struct usart_tx {
+	uint8_t buf[USART_TX_BUF_SIZE];
+	volatile uint16_t head;
+	volatile uint16_t tail;  // changed by interrupt only
+	volatile uint16_t dma_len;  // 0 if DMA is idle
+	volatile uint16_t dma_released;  // bytes of current DMA transfer already released in buffer
+	volatile bool is_truncated;
+	uint8_t policy;
+	bool is_enabled;
+	uint32_t dropped;
+};
+
+static struct usart_rx usart_rx[USART_BUF_COUNT];
+static struct usart_tx usart_tx[USART_BUF_COUNT];
+
+// DMA1 channels of USART1..USART3 TX requests
+static const uint8_t usart_tx_dma_ch[USART_BUF_COUNT] = { 4, 7, 2 };
+
+static RAMFUNC usart_regs_t *get_usart_regs(uint8_t num)
 {
 	if (num == 1)
 		return (usart_regs_t *)USART1_BASE_ADDR;
@@ -45,207 +91,444 @@ static usart_regs_t *get_usart_regs(uint8_t num)
 		return NULL;
 }
 
+static struct usart_rx *get_usart_rx(uint8_t num)
+{
+	if (num < 1 || num > USART_BUF_COUNT || !usart_rx[num - 1].is_enabled)
+		return NULL;
+
+	return &usart_rx[num - 1];
+}
+
+static struct usart_tx *get_usart_tx(uint8_t num)
+{
+	if (num < 1 || num > USART_BUF_COUNT || !usart_tx[num - 1].is_enabled)
+		return NULL;
+
+	return &usart_tx[num - 1];
+}
+
+static RAMFUNC void usart_irq(uint8_t num)
+{
+	usart_regs_t *regs = get_usart_regs(num);
+	struct usart_rx *rx = &usart_rx[num - 1];
+	uint32_t sr = regs->SR;
+	uint8_t data;
+	uint16_t head;
+
+	if (!(sr & (SR_RXNE | SR_ORE)))
+		return;
+
+	data = regs->DR;  // reading SR and then DR clears error flags
+	if (sr & SR_ORE)
+		rx->stats.overrun++;
+
+	if (sr & SR_NE)
+		rx->stats.noise++;
+
+	if (sr & SR_FE) {
+		rx->stats.framing++;
+		return;
+	}
+
+	head = (rx->head + 1) & (USART_RX_BUF_SIZE - 1);
+	if (head == rx->tail) {
+		rx->stats.dropped++;
+		return;
+	}
+
+	rx->buf[rx->head] = data;
+	rx->head = head;
+}
+
+// Start DMA for the contiguous part of buffer. DMA must be idle
+static void usart_tx_start(uint8_t num, struct usart_tx *tx)
+{
+	usart_regs_t *regs = get_usart_regs(num);
+	uint16_t head = tx->head;
+	uint16_t tail = tx->tail;
+	uint16_t len = (head >= tail) ? head - tail : USART_TX_BUF_SIZE - tail;
+
+	if (!len) {
+		tx->is_truncated = false;  // everything is sent, so new data can be queued again
+		return;
+	}
+
+	tx->dma_released = 0;
+	tx->dma_len = len;
+	dma_start(usart_tx_dma_ch[num - 1], (uintptr_t)&regs->DR, (uintptr_t)&tx->buf[tail], len,
+		  DMA_FROM_MEM | DMA_MEM_INC | DMA_PSIZE_8 | DMA_MSIZE_8 | DMA_IRQ_TC | DMA_IRQ_HT);
+}
+
+static void usart_tx_dma_irq(uint8_t num)
+{
+	struct usart_tx *tx = &usart_tx[num - 1];
+	uint8_t ch = usart_tx_dma_ch[num - 1];
+	uint32_t flags = dma_get_flags(ch);
+	uint16_t done;
+
+	dma_clear_flags(ch, flags);
+	if (!tx->dma_len)
+		return;
+
+	// Release already sent part of buffer on half transfer too, so writer can continue earlier
+	done = (flags & DMA_FLAG_TC) ? tx->dma_len : tx->dma_len - dma_get_remaining(ch);
+	tx->tail = (tx->tail + done - tx->dma_released) & (USART_TX_BUF_SIZE - 1);
+	tx->dma_released = done;
+
+	if (flags & (DMA_FLAG_TC | DMA_FLAG_TE)) {
+		dma_stop(ch);
+		tx->dma_len = 0;
+		usart_tx_start(num, tx);
+	}
+}
+
+RAMFUNC void USART1_IRQHandler(void)
+{
+	usart_irq(1);
+}
+
+RAMFUNC void USART2_IRQHandler(void)
+{
+	usart_irq(2);
+}
+
+RAMFUNC void USART3_IRQHandler(void)
+{
+	usart_irq(3);
+}
+
+void DMA1_Channel4_IRQHandler(void)
+{
+	usart_tx_dma_irq(1);
+}
+
+void DMA1_Channel7_IRQHandler(void)
+{
+	usart_tx_dma_irq(2);
+}
+
+void DMA1_Channel2_IRQHandler(void)
+{
+	usart_tx_dma_irq(3);
+}
+
+// BRR is USARTDIV in 12.4 fixed point, so it is pclk / baudrate rounded to nearest
+static uint32_t usart_calc_brr(uint32_t pclk, uint32_t baudrate)
+{
+	return (pclk + baudrate / 2) / baudrate;
+}
+
 void usart_init(uint8_t num, uint32_t pclk, uint32_t boudrate)
 {
 	usart_regs_t *regs = get_usart_regs(num);
-	uint32_t div;
 
 	regs->CR1 = 0;
 	regs->CR2 = 0;
 	regs->CR3 = 0;
-	div = pclk / boudrate;
-	regs->BRR = div;
+	regs->BRR = usart_calc_brr(pclk, boudrate);
 	regs->CR1 = CR1_UE | CR1_TE | CR1_RE;
 }
 
-void usart_flush(uint8_t num)
+int usart_set_baudrate(uint8_t num, uint32_t pclk, uint32_t baudrate)
 {
 	usart_regs_t *regs = get_usart_regs(num);
+	uint32_t brr;
 
-	while (!(regs->SR & SR_TC)) {
-	}
+	if (!baudrate)
+		return -1;
+
+	brr = usart_calc_brr(pclk, baudrate);
+	if (brr < USART_BRR_MIN || brr > USART_BRR_MAX)
+		return -1;
+
+	usart_flush(num);
+	regs->CR1 &= ~CR1_UE;
+	regs->BRR = brr;
+	regs->CR1 |= CR1_UE;
+
+	return 0;
 }
 
-static void _usart_send_byte(usart_regs_t *regs, uint8_t data)
+uint32_t usart_get_baudrate(uint8_t num, uint32_t pclk)
 {
-	while (!(regs->SR & SR_TXE)) {
-	}
-	regs->DR = data;
+	usart_regs_t *regs = get_usart_regs(num);
+
+	return regs->BRR ? pclk / regs->BRR : 0;
 }
 
-void usart_send_byte(uint8_t num, uint8_t data)
+// Received bytes are collected by interrupt into buffer instead of polling of data register
+void usart_rx_irq_enable(uint8_t num)
 {
 	usart_regs_t *regs = get_usart_regs(num);
+	struct usart_rx *rx;
 
-	_usart_send_byte(regs, data);
+	if (num < 1 || num > USART_BUF_COUNT)
+		return;
+
+	rx = &usart_rx[num - 1];
+	rx->head = 0;
+	rx->tail = 0;
+	rx->is_enabled = true;
+	regs->CR1 |= CR1_RXNEIE;
+	nvic_enable_irq(IRQ_USART1 + num - 1);
 }
 
-void usart_write(uint8_t num, void *ptr, int len)
+// Sent data is queued into buffer and transmitted by DMA. DMA1 clock must be enabled before
+void usart_tx_dma_enable(uint8_t num, uint8_t policy)
 {
 	usart_regs_t *regs = get_usart_regs(num);
+	struct usart_tx *tx;
+
+	if (num < 1 || num > USART_BUF_COUNT)
+		return;
+
+	usart_flush(num);
+	tx = &usart_tx[num - 1];
+	tx->head = 0;
+	tx->tail = 0;
+	tx->dma_len = 0;
+	tx->is_truncated = false;
+	tx->policy = policy;
+	tx->is_enabled = true;
+	regs->CR3 |= CR3_DMAT;
+	nvic_enable_irq(IRQ_DMA1_CH1 + usart_tx_dma_ch[num - 1] - 1);
+}
+
+void usart_set_tx_policy(uint8_t num, uint8_t policy)
+{
+	struct usart_tx *tx = get_usart_tx(num);
 
-	for (int i = 0; i < len; i++)
-		_usart_send_byte(regs, *(uint8_t *)(ptr + i));
+	if (tx)
+		tx->policy = policy;
 }
 
-static void _usart_putc(usart_regs_t *regs, char c)
+void usart_get_stats(uint8_t num, struct usart_stats *stats)
 {
-	_usart_send_byte(regs, c);
-	if (c == '\n')
-		_usart_send_byte(regs, '\r');
+	struct usart_rx *rx = get_usart_rx(num);
+	struct usart_tx *tx = get_usart_tx(num);
+
+	if (rx)
+		*stats = rx->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+
+	stats->tx_dropped = tx ? tx->dropped : 0;
 }
 
-void usart_putc(uint8_t num, char c)
+void usart_flush(uint8_t num)
 {
 	usart_regs_t *regs = get_usart_regs(num);
+	struct usart_tx *tx = get_usart_tx(num);
 
-	_usart_putc(regs, c);
+	if (tx) {
+		while (tx->dma_len || tx->head != tx->tail) {
+		}
+	}
+
+	while (!(regs->SR & SR_TC)) {
+	}
 }
 
-static void _usart_puts(usart_regs_t *regs, char *s)
+static void _usart_send_byte(usart_regs_t *regs, uint8_t data)
 {
-	while (*s) {
-		_usart_putc(regs, *s);
-		s++;
+	while (!(regs->SR & SR_TXE)) {
 	}
+	regs->DR = data;
 }
 
-void usart_puts(uint8_t num, char *s)
+static uint16_t usart_tx_free(struct usart_tx *tx)
 {
-	usart_regs_t *regs = get_usart_regs(num);
+	return (tx->tail - tx->head - 1) & (USART_TX_BUF_SIZE - 1);
+}
+
+// Returns false if data was not queued because of buffer policy
+static bool usart_tx_queue(struct usart_tx *tx, uint8_t num, const uint8_t *data, unsigned int len)
+{
+	while (len) {
+		uint16_t head = tx->head;
+		uint16_t free = usart_tx_free(tx);
+		uint16_t chunk;
+
+		if (tx->is_truncated) {
+			tx->dropped += len;
+			return false;
+		}
+
+		// One byte is reserved for truncation marker
+		if (tx->policy == USART_TX_TRUNCATE && free)
+			free--;
+
+		if (!free) {
+			switch (tx->policy) {
+			case USART_TX_DROP:
+				tx->dropped += len;
+				return false;
+			case USART_TX_TRUNCATE:
+				// Ring can be full without reserved byte if policy was changed meanwhile
+				if (usart_tx_free(tx)) {
+					tx->buf[head] = USART_TX_TRUNC_MARKER;
+					tx->head = (head + 1) & (USART_TX_BUF_SIZE - 1);
+				}
+				tx->is_truncated = true;
+				tx->dropped += len;
+				return false;
+			default:
+				// Wait until DMA releases some space
+				if (!tx->dma_len)
+					usart_tx_start(num, tx);
+				continue;
+			}
+		}
 
-	_usart_puts(regs, s);
+		chunk = USART_TX_BUF_SIZE - head;
+		if (chunk > free)
+			chunk = free;
+
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(&tx->buf[head], data, chunk);
+		tx->head = (head + chunk) & (USART_TX_BUF_SIZE - 1);
+		data += chunk;
+		len -= chunk;
+	}
+
+	return true;
 }
 
-uint8_t usart_wait_and_recv_byte(uint8_t num)
+// Raw output: queue into buffer if DMA is used, otherwise wait for every byte
+static void usart_out(uint8_t num, const void *ptr, unsigned int len)
 {
-	usart_regs_t *regs = get_usart_regs(num);
+	struct usart_tx *tx = get_usart_tx(num);
+
+	if (!tx) {
+		usart_regs_t *regs = get_usart_regs(num);
+
+		for (unsigned int i = 0; i < len; i++)
+			_usart_send_byte(regs, ((uint8_t *)ptr)[i]);
 
-	while (!(regs->SR & SR_RXNE)) {
+		return;
 	}
 
-	return regs->DR;
+	usart_tx_queue(tx, num, ptr, len);
+	// Interrupt can't start DMA here: it is started from interrupt only while it is busy
+	if (!tx->dma_len)
+		usart_tx_start(num, tx);
 }
 
-uint8_t usart_recv_byte(uint8_t num)
+void usart_send_byte(uint8_t num, uint8_t data)
 {
-	usart_regs_t *regs = get_usart_regs(num);
+	usart_out(num, &data, 1);
+}
 
-	return regs->DR;
+void usart_write(uint8_t num, void *ptr, int len)
+{
+	usart_out(num, ptr, len);
 }
 
-bool usart_is_received(uint8_t num)
+bool usart_try_write(uint8_t num, void *ptr, int len)
 {
-	usart_regs_t *regs = get_usart_regs(num);
+	struct usart_tx *tx = get_usart_tx(num);
 
-	return !!(regs->SR & SR_RXNE);
+	// Same reserve as in usart_tx_queue, so frame is never truncated
+	if (!tx || tx->is_truncated || usart_tx_free(tx) < len + (tx->policy == USART_TX_TRUNCATE))
+		return false;
+
+	usart_tx_queue(tx, num, ptr, len);
+	if (!tx->dma_len)
+		usart_tx_start(num, tx);
+
+	return true;
+}
+
+unsigned int usart_get_tx_free(uint8_t num)
+{
+	struct usart_tx *tx = get_usart_tx(num);
+
+	if (!tx)
+		return USART_TX_BUF_SIZE;
+
+	return tx->is_truncated ? 0 : usart_tx_free(tx);
 }
 
-static void usart_puthex(usart_regs_t *regs, uint32_t hex, uint32_t digits)
+void usart_putc(uint8_t num, char c)
 {
-	static const char tohex[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
-					'8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
-	int start = 0;
+	if (c == '\n')
+		usart_out(num, "\n\r", 2);
+	else
+		usart_out(num, &c, 1);
+}
 
-	for (int i = 0; i < 8; i++) {
-		if ((hex >> (4 * (7 - i))) & 0xF)
-			break;
-		start++;
+// Text output: end of line is corrected
+static void usart_text_sink(void *ctx, const char *s, unsigned int len)
+{
+	uint8_t num = *(uint8_t *)ctx;
+	const char *start = s;
+	const char *end = s + len;
+
+	for (; s < end; s++) {
+		if (*s == '\n') {
+			usart_out(num, start, s - start);
+			usart_out(num, "\n\r", 2);
+			start = s + 1;
+		}
 	}
-	if (digits < (8 - start))
-		digits = 8 - start;
 
-	start = 8 - digits;
+	usart_out(num, start, end - start);
+}
+
+void usart_puts(uint8_t num, char *s)
+{
+	usart_text_sink(&num, s, strlen(s));
+}
 
-	if (start > 7)
-		start = 7;
+uint8_t usart_wait_and_recv_byte(uint8_t num)
+{
+	while (!usart_is_received(num)) {
+	}
 
-	for (int i = start; i < 8; i++)
-		_usart_putc(regs, tohex[(hex >> (4 * (7 - i))) & 0xF]);
+	return usart_recv_byte(num);
 }
 
-static void usart_putint(usart_regs_t *regs, uint32_t data, int is_signed)
+uint8_t usart_recv_byte(uint8_t num)
 {
-	char buf[12];
-	int pos = sizeof(buf);
-	int is_neg = is_signed && (((int32_t)data) < 0);
+	usart_regs_t *regs = get_usart_regs(num);
+	struct usart_rx *rx = get_usart_rx(num);
+	uint8_t data;
 
-	buf[--pos] = '\0';
-	if (data == 0) {
-		buf[--pos] = '0';
-	} else if (is_neg)
-		data = -((int32_t)data);
+	if (!rx)
+		return regs->DR;
 
-	while (data) {
-		buf[--pos] = '0' + (data % 10);
-		data /= 10;
-	}
-	if (is_neg)
-		buf[--pos] = '-';
+	if (rx->head == rx->tail)
+		return 0;
+
+	data = rx->buf[rx->tail];
+	rx->tail = (rx->tail + 1) & (USART_RX_BUF_SIZE - 1);
 
-	_usart_puts(regs, buf + pos);
+	return data;
 }
 
-void usart_printf(uint8_t num, char *s, ...)
+bool usart_is_received(uint8_t num)
 {
 	usart_regs_t *regs = get_usart_regs(num);
-	uint32_t digits = 0;
-	int is_percent_handler = 0;
+	struct usart_rx *rx = get_usart_rx(num);
+
+	if (rx)
+		return rx->head != rx->tail;
+
+	return !!(regs->SR & SR_RXNE);
+}
+
+void usart_vprintf(uint8_t num, char *s, va_list args)
+{
+	format_vprintf(usart_text_sink, &num, s, args);
+}
 
+void usart_printf(uint8_t num, char *s, ...)
+{
 	va_list args;
+
 	va_start(args, s);
-	while (*s) {
-		if (*s == '%') {
-			digits = 0;
-			is_percent_handler = 1;
-			s++;
-			continue;
-		}
-		if (is_percent_handler) {
-			switch (*s) {
-			case '%':
-				_usart_putc(regs, *s);
-				is_percent_handler = 0;
-				break;
-			case '#':
-				if (s[1] == 'x' || s[1] == 'X') {
-					s++;
-					_usart_puts(regs, "0x");
-					usart_puthex(regs, va_arg(args, uint32_t), digits);
-				} else {
-					_usart_putc(regs, '%');
-					_usart_putc(regs, '#');
-				}
-				is_percent_handler = 0;
-				break;
-			case 'x':
-			case 'X':
-				usart_puthex(regs, va_arg(args, uint32_t), digits);
-				is_percent_handler = 0;
-				break;
-			case 'd':
-			case 'i':
-			case 'u':
-				usart_putint(regs, va_arg(args, uint32_t), *s != 'u');
-				is_percent_handler = 0;
-				break;
-			case 's':
-				_usart_puts(regs, va_arg(args, char *));
-				is_percent_handler = 0;
-				break;
-			default:
-				if (*s >= '0' && *s <= '9') {
-					digits = digits * 10 + (*s - '0');
-				} else {
-					_usart_putc(regs, '%');
-					_usart_putc(regs, *s);
-					is_percent_handler = 0;
-				}
-				break;
-			}
-			s++;
-		} else
-			_usart_putc(regs, *s++);
-	}
+	usart_vprintf(num, s, args);
 	va_end(args);
 }